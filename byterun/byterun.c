@@ -15,6 +15,7 @@ typedef struct {
   int  *public_ptr;              /* A pointer to the beginning of publics table    */
   char *code_ptr;                /* A pointer to the bytecode itself               */
   int  *global_ptr;              /* A pointer to the global area                   */
+  int   code_size;               /* The size (in bytes) of the bytecode            */
   int   stringtab_size;          /* The size (in bytes) of the string table        */
   int   global_area_size;        /* The size (in words) of global area             */
   int   public_symbols_number;   /* The number of public symbols                   */
@@ -50,7 +51,7 @@ bytefile* read_file (char *fname) {
     failure ("%s\n", strerror (errno));
   }
 
-  file = (bytefile*) malloc (sizeof(int)*4 + (size = ftell (f)));
+  file = (bytefile*) malloc (sizeof(int)*5 + (size = ftell (f)));
 
   if (file == 0) {
     failure ("*** FAILURE: unable to allocate memory.\n");
@@ -68,22 +69,24 @@ bytefile* read_file (char *fname) {
   file->public_ptr  = (int*) file->buffer;
   file->code_ptr    = &file->string_ptr [file->stringtab_size];
   file->global_ptr  = (int*) malloc (file->global_area_size * sizeof (int));
+  file->code_size   = size - (file->code_ptr - (char*) &file->stringtab_size);
   
   return file;
 }
 
-/* Disassembles the bytecode pool */
-void disassemble (FILE *f, bytefile *bf) {
-  
 # define INT    (ip += sizeof (int), *(int*)(ip - sizeof (int)))
 # define BYTE   *ip++
 # define STRING get_string (bf, INT)
 # define FAIL   failure ("ERROR: invalid opcode %d-%d\n", h, l)
-  
-  char *ip     = bf->code_ptr;
-  char *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
-  char *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
-  char *lds [] = {"LD", "LDA", "ST"};
+
+static char *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
+static char *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
+static char *lds [] = {"LD", "LDA", "ST"};
+
+/* Disassembles the bytecode pool */
+void disassemble (FILE *f, bytefile *bf) {
+  char *ip = bf->code_ptr;
+
   do {
     char x = BYTE,
          h = (x & 0xF0) >> 4,
@@ -294,8 +297,725 @@ void dump_file (FILE *f, bytefile *bf) {
   disassemble (f, bf);
 }
 
+
+/* ======================================== */
+/*              Interpreter                 */
+/* ======================================== */
+
+/* The operand stack grows down from the end of the stack area, right below
+   the global variables. The garbage collector scans the stack from
+   __gc_stack_top to __gc_stack_bottom, so the interpreter points the former
+   at the top of the operand stack before each call which may allocate, and
+   the latter at the end of the area; this way the live values and the
+   globals are the roots, and nothing else is. */
+
+# define STACK_SIZE    (1024 * 1024)  /* The size of the stack area, in words           */
+# define STACK_RESERVE 4096           /* The words left for the operands of a function */
+# define FRAMES        (256 * 1024)   /* The maximal depth of calls                    */
+
+# define UNBOXED(x) (((int) (x)) &  0x0001)
+# define UNBOX(x)   (((int) (x)) >> 1)
+# define BOX(x)     ((((int) (x)) << 1) | 0x0001)
+
+# define SEXP_TAG    0x00000005
+# define CLOSURE_TAG 0x00000007
+
+extern __thread size_t __gc_stack_top, __gc_stack_bottom;
+
+extern void  __gc_init ();
+extern void  set_args  (int argc, char *argv[]);
+extern void* alloc     (size_t);
+
+extern int   LtagHash          (char*);
+extern void* Bstring           (void*);
+extern void* Belem             (void*, int);
+extern void* Bsta              (void*, int, void*);
+extern int   Btag              (void*, int, int);
+extern int   Barray_patt       (void*, int);
+extern int   Bstring_patt      (void*, void*);
+extern int   Bstring_tag_patt  (void*);
+extern int   Barray_tag_patt   (void*);
+extern int   Bsexp_tag_patt    (void*);
+extern int   Bboxed_patt       (void*);
+extern int   Bunboxed_patt     (void*);
+extern int   Bclosure_tag_patt (void*);
+extern void  Bmatch_failure    (void*, char*, int, int);
+extern int   Lread             ();
+extern int   Lwrite            (int);
+extern int   Llength           (void*);
+extern void* Lstring           (void*);
+extern void* LmakeArray        (int);
+
+static size_t stack [STACK_SIZE];
+
+/* A call frame */
+typedef struct {
+  char   *ip;       /* The return address; NULL for main                  */
+  size_t *base;     /* The top of the stack after the return              */
+  size_t *args;     /* The first argument; the rest go down from it       */
+  size_t *locals;   /* The first local; the rest go down from it          */
+  size_t *closure;  /* The stack slot with the closure, or NULL           */
+  int     func;     /* The function of the caller (for the profiler)     */
+  int     line;     /* The current line of the caller (for the profiler) */
+} frame;
+
+static frame *frames;
+
+/* ======================================== */
+/*               Profiler                   */
+/* ======================================== */
+
+/* With --profile the interpreter counts the executed opcodes, the pairs of
+   consecutive opcodes, and the instructions executed and the time spent in
+   each function and on each source line (as given by LINE). Functions are
+   identified by their entry points and named after the public symbols where
+   possible; a function without a public name is reported by its address and
+   the first line executed in it. The report is written at exit. */
+
+typedef struct {
+  int        offset;   /* The offset of the entry point        */
+  int        line;     /* The first line executed, 0 if none   */
+  long long  calls;
+  long long  insns;    /* Instructions executed in the function itself */
+  long long  nsec;     /* Time spent in the function itself            */
+} prof_fun;
+
+static int        prof         = 0;
+static char      *prof_report  = NULL;
+static bytefile  *prof_file    = NULL;
+static long long  prof_ops [256];
+static long long *prof_pairs   = NULL;   /* 256 x 256 */
+static int        prof_prev    = 255;
+static prof_fun  *prof_funs    = NULL;
+static int        prof_nfuns   = 0, prof_funs_size = 0;
+static int       *prof_fun_at  = NULL;   /* Entry offset -> function index + 1 */
+static int        prof_cur     = 0;      /* The current function */
+static int        prof_line    = 0;      /* The current line     */
+static long long *prof_lines   = NULL;
+static int        prof_nlines  = 0;
+static long long  prof_clock;
+
+static long long prof_now (void) {
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Gets the index of the function with the given entry point */
+static int prof_function (int offset) {
+  int i = prof_fun_at [offset] - 1;
+
+  if (i < 0) {
+    if (prof_nfuns == prof_funs_size) {
+      prof_funs_size = prof_funs_size ? 2 * prof_funs_size : 256;
+      prof_funs      = (prof_fun*) realloc (prof_funs, prof_funs_size * sizeof (prof_fun));
+
+      if (prof_funs == NULL) failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    i = prof_nfuns++;
+    memset (&prof_funs [i], 0, sizeof (prof_fun));
+    prof_funs [i].offset = offset;
+    prof_fun_at [offset] = i + 1;
+  }
+
+  return i;
+}
+
+/* Switches to the function f, charging the time so far to the current one */
+static void prof_switch (int f, int line) {
+  long long now = prof_now ();
+
+  prof_funs [prof_cur].nsec += now - prof_clock;
+  prof_clock = now;
+  prof_cur   = f;
+  prof_line  = line;
+}
+
+static void prof_call (int offset) {
+  int f = prof_function (offset);
+
+  prof_funs [f].calls++;
+  prof_switch (f, 0);
+}
+
+static void prof_set_line (int line) {
+  if (line < 0) return;
+  
+  if (line >= prof_nlines) {
+    int n = line + 1024;
+
+    prof_lines = (long long*) realloc (prof_lines, n * sizeof (long long));
+
+    if (prof_lines == NULL) failure ("*** FAILURE: unable to allocate memory.\n");
+
+    memset (&prof_lines [prof_nlines], 0, (n - prof_nlines) * sizeof (long long));
+    prof_nlines = n;
+  }
+
+  if (prof_funs [prof_cur].line == 0) prof_funs [prof_cur].line = line;
+
+  prof_line = line;
+}
+
+static void prof_insn (unsigned char op) {
+  prof_ops [op]++;
+  prof_pairs [prof_prev * 256 + op]++;
+  prof_prev = op;
+  prof_funs [prof_cur].insns++;
+
+  if (prof_line) prof_lines [prof_line]++;
+}
+
+/* Gets a printable name for an opcode */
+static char* op_name (int op) {
+  static char *ones [] = {"CONST", "STRING", "SEXP", "STI", "STA", "JMP", "END", "RET", "DROP", "DUP", "SWAP", "ELEM"};
+  static char *fives[] = {"CJMPz", "CJMPnz", "BEGIN", "CBEGIN", "CLOSURE", "CALLC", "CALL", "TAG", "ARRAY", "FAIL", "LINE"};
+  static char *calls[] = {"Lread", "Lwrite", "Llength", "Lstring", "Barray"};
+  static char  names [256][24];
+  int          h = op >> 4, l = op & 0x0F;
+  char        *s = names [op];
+
+  if (*s) return s;
+  
+  if      (h == 0 && l >= 1 && l <= 13) sprintf (s, "BINOP %s", ops [l-1]);
+  else if (h == 1 && l <= 11)           sprintf (s, "%s", ones [l]);
+  else if (h >= 2 && h <= 4 && l <= 3)  sprintf (s, "%s %c", lds [h-2], "GLAC" [l]);
+  else if (h == 5 && l <= 10)           sprintf (s, "%s", fives [l]);
+  else if (h == 6 && l <= 6)            sprintf (s, "PATT %s", pats [l]);
+  else if (h == 7 && l <= 4)            sprintf (s, "CALL %s", calls [l]);
+  else                                  sprintf (s, "0x%.2x", op);
+
+  return s;
+}
+
+/* Gets a printable name for a function */
+static char* fun_name (prof_fun *f) {
+  static char buf [64];
+  int i;
+
+  for (i=0; i < prof_file->public_symbols_number; i++)
+    if (get_public_offset (prof_file, i) == f->offset) return get_public_name (prof_file, i);
+
+  sprintf (buf, "<0x%.8x>", f->offset);
+  
+  return buf;
+}
+
+static long long *prof_sort_keys;
+
+static int prof_compare (const void *a, const void *b) {
+  long long x = prof_sort_keys [*(int*) a], y = prof_sort_keys [*(int*) b];
+
+  return x < y ? 1 : x > y ? -1 : *(int*) a - *(int*) b;
+}
+
+/* Returns the indices of the nonzero keys, in the descending order of keys */
+static int* prof_sort (long long *keys, int n, int *m) {
+  int *idx = (int*) malloc ((n + 1) * sizeof (int));
+  int  i;
+
+  if (idx == NULL) failure ("*** FAILURE: unable to allocate memory.\n");
+  
+  for (i=0, *m=0; i<n; i++)
+    if (keys [i]) idx [(*m)++] = i;
+
+  prof_sort_keys = keys;
+  qsort (idx, *m, sizeof (int), prof_compare);
+
+  return idx;
+}
+
+# define PROF_TOP 50
+
+static void prof_dump (void) {
+  FILE      *f = stderr;
+  long long  total = 0, calls = 0, nsec = 0, *keys;
+  int       *idx, n, i;
+
+  prof_switch (prof_cur, prof_line);
+
+  if (prof_report && (f = fopen (prof_report, "w")) == NULL) {
+    fprintf (stderr, "byterun: cannot write the profile to %s: %s\n", prof_report, strerror (errno));
+    return;
+  }
+
+  for (i=0; i<256; i++) total += prof_ops [i];
+  for (i=0; i<prof_nfuns; i++) {
+    calls += prof_funs [i].calls;
+    nsec  += prof_funs [i].nsec;
+  }
+
+  fprintf (f, "Instructions: %lld\n", total);
+  fprintf (f, "Calls       : %lld\n", calls);
+  fprintf (f, "Time        : %.3f ms\n", nsec / 1e6);
+  
+  if (total == 0) total = 1;
+
+  fprintf (f, "\nOpcodes:\n");
+  idx = prof_sort (prof_ops, 256, &n);
+  for (i=0; i<n; i++)
+    fprintf (f, "  %14lld %6.2f%%  %s\n", prof_ops [idx[i]], 100.0 * prof_ops [idx[i]] / total, op_name (idx[i]));
+  free (idx);
+
+  fprintf (f, "\nOpcode pairs (top %d):\n", PROF_TOP);
+  idx = prof_sort (prof_pairs, 256 * 256, &n);
+  for (i=0; i<n && i<PROF_TOP; i++)
+    fprintf (f, "  %14lld %6.2f%%  %s; %s\n",
+             prof_pairs [idx[i]], 100.0 * prof_pairs [idx[i]] / total, op_name (idx[i] / 256), op_name (idx[i] % 256));
+  free (idx);
+
+  fprintf (f, "\nFunctions (instructions, calls, self time, first line, name):\n");
+  keys = (long long*) malloc ((prof_nfuns + 1) * sizeof (long long));
+  if (keys == NULL) failure ("*** FAILURE: unable to allocate memory.\n");
+  for (i=0; i<prof_nfuns; i++) keys [i] = prof_funs [i].insns;
+  idx = prof_sort (keys, prof_nfuns, &n);
+  for (i=0; i<n; i++) {
+    prof_fun *p = &prof_funs [idx[i]];
+
+    fprintf (f, "  %14lld %6.2f%%  %10lld  %10.3f ms  %6d  %s\n",
+             p->insns, 100.0 * p->insns / total, p->calls, p->nsec / 1e6, p->line, fun_name (p));
+  }
+  free (idx);
+  free (keys);
+
+  fprintf (f, "\nLines (top %d):\n", PROF_TOP);
+  idx = prof_sort (prof_lines, prof_nlines, &n);
+  for (i=0; i<n && i<PROF_TOP; i++)
+    fprintf (f, "  %14lld %6.2f%%  %d\n", prof_lines [idx[i]], 100.0 * prof_lines [idx[i]] / total, idx[i]);
+  free (idx);
+
+  if (f != stderr) fclose (f);
+}
+
+static void prof_init (bytefile *bf, int entry) {
+  prof_file   = bf;
+  prof_pairs  = (long long*) calloc (256 * 256, sizeof (long long));
+  prof_fun_at = (int*) calloc (bf->code_size, sizeof (int));
+
+  if (prof_pairs == NULL || prof_fun_at == NULL) failure ("*** FAILURE: unable to allocate memory.\n");
+
+  prof_cur   = prof_function (entry);
+  prof_funs [prof_cur].calls = 1;
+  prof_clock = prof_now ();
+  
+  atexit (prof_dump);
+}
+
+/* ======================================== */
+
+/* Gets the hash of a tag by its position in the string table */
+static int tag_hash (bytefile *bf, int pos) {
+  static int *hashes = NULL;
+
+  if (hashes == NULL && (hashes = (int*) calloc (bf->stringtab_size, sizeof (int))) == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  if (hashes [pos] == 0) hashes [pos] = LtagHash (get_string (bf, pos));
+
+  return hashes [pos];
+}
+
+/* Gets the address of a variable */
+static size_t* address (frame *fp, int kind, int i) {
+  switch (kind) {
+  case 0: return &stack [STACK_SIZE - 1 - i];
+  case 1: return fp->locals - i;
+  case 2: return fp->args - i;
+  case 3: return &((size_t*) *fp->closure) [i+1];
+  default:
+    failure ("ERROR: invalid variable designation %d\n", kind);
+  }
+
+  return NULL;
+}
+
+/* Runs the program from the public symbol "main"; fname is the name of
+   the bytecode file, argv are the arguments of the program */
+void interpret (bytefile *bf, char *fname, int argc, char *argv[]) {
+
+# define PUSH(x) do {size_t v = (size_t) (x); *--sp = v;} while (0)
+# define POP     (*sp++)
+# define SYNC    (__gc_stack_top = (size_t) (sp - 1))
+
+  char   *ip    = bf->code_ptr;
+  size_t *sp    = &stack [STACK_SIZE - bf->global_area_size];
+  frame  *fp;
+  int     i;
+
+  for (i=0; i < bf->public_symbols_number; i++)
+    if (strcmp (get_public_name (bf, i), "main") == 0) ip = bf->code_ptr + get_public_offset (bf, i);
+
+  if ((frames = (frame*) malloc (FRAMES * sizeof (frame))) == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  for (i=0; i < bf->global_area_size; i++) stack [STACK_SIZE - 1 - i] = BOX(0);
+
+  __gc_init ();
+  __gc_stack_bottom = (size_t) &stack [STACK_SIZE];
+  SYNC;
+  set_args (argc, argv);
+
+  /* main takes two (unused) arguments */
+  PUSH (BOX(0));
+  PUSH (BOX(0));
+  fp          = frames;
+  fp->ip      = NULL;
+  fp->base    = sp + 2;
+  fp->args    = sp + 1;
+  fp->closure = NULL;
+
+  if (prof) prof_init (bf, ip - bf->code_ptr);
+
+  do {
+    unsigned char x = BYTE,
+                  h = (x & 0xF0) >> 4,
+                  l = x & 0x0F;
+
+    if (prof) prof_insn (x);
+
+    switch (h) {
+    case 15:
+      goto stop;
+
+    /* BINOP */
+    case 0: {
+      int b = POP, a = *sp, r;
+
+      switch (l) {
+      case  1: r = UNBOX(a) +  UNBOX(b); break;
+      case  2: r = UNBOX(a) -  UNBOX(b); break;
+      case  3: r = UNBOX(a) *  UNBOX(b); break;
+      case  4: r = UNBOX(a) /  UNBOX(b); break;
+      case  5: r = UNBOX(a) %  UNBOX(b); break;
+      case  6: r = UNBOX(a) <  UNBOX(b); break;
+      case  7: r = UNBOX(a) <= UNBOX(b); break;
+      case  8: r = UNBOX(a) >  UNBOX(b); break;
+      case  9: r = UNBOX(a) >= UNBOX(b); break;
+      case 10: r = a == b; break; /* boxed values are compared by identity */
+      case 11: r = a != b; break;
+      case 12: r = UNBOX(a) && UNBOX(b); break;
+      case 13: r = UNBOX(a) || UNBOX(b); break;
+      default: FAIL;
+      }
+
+      *sp = BOX(r);
+      break;
+    }
+
+    case 1:
+      switch (l) {
+      case  0:
+        PUSH (BOX(INT));
+        break;
+
+      case  1:
+        SYNC;
+        PUSH (Bstring (STRING));
+        break;
+
+      case  2: {
+        int     t = tag_hash (bf, INT), n = INT;
+        size_t *r;
+
+        SYNC;
+        r    = (size_t*) alloc (sizeof (int) * (n + 2));
+        r[0] = UNBOX(t);
+        r[1] = SEXP_TAG | (n << 3);
+        for (i=0; i<n; i++) r[i+2] = sp [n-1-i];
+        sp += n;
+        PUSH (r + 2);
+        break;
+      }
+
+      case  3: {
+        size_t v = POP;
+
+        *(size_t*) *sp = v;
+        *sp = v;
+        break;
+      }
+
+      case  4: {
+        size_t v = POP, k = POP;
+
+        *sp = (size_t) Bsta ((void*) v, k, (void*) *sp);
+        break;
+      }
+
+      case  5:
+        ip = bf->code_ptr + INT;
+        break;
+
+      case  6:
+      case  7: {
+        size_t r   = *sp;
+        char  *ret = fp->ip;
+
+        sp = fp->base;
+        PUSH (r);
+
+        if (ret == NULL) goto stop;
+
+        if (prof) prof_switch (fp->func, fp->line);
+
+        ip = ret;
+        fp--;
+        break;
+      }
+
+      case  8:
+        sp++;
+        break;
+
+      case  9:
+        PUSH (*sp);
+        break;
+
+      case 10: {
+        size_t v = sp [0];
+
+        sp [0] = sp [1];
+        sp [1] = v;
+        break;
+      }
+
+      case 11: {
+        size_t k = POP;
+
+        *sp = (size_t) Belem ((void*) *sp, k);
+        break;
+      }
+
+      default:
+        FAIL;
+      }
+      break;
+
+    /* LD, LDA, ST */
+    case 2:
+      PUSH (*address (fp, l, INT));
+      break;
+
+    case 3: {
+      size_t *a = address (fp, l, INT);
+
+      PUSH (a);
+      PUSH (a);
+      break;
+    }
+
+    case 4:
+      *address (fp, l, INT) = *sp;
+      break;
+
+    case 5:
+      switch (l) {
+      case  0: {
+        int target = INT;
+
+        if (UNBOX(POP) == 0) ip = bf->code_ptr + target;
+        break;
+      }
+
+      case  1: {
+        int target = INT;
+
+        if (UNBOX(POP) != 0) ip = bf->code_ptr + target;
+        break;
+      }
+
+      case  2:
+      case  3: {
+        int n;
+
+        ip += sizeof (int);  /* the number of arguments */
+        n   = INT;
+
+        if (sp - n - STACK_RESERVE < stack) failure ("byterun: stack overflow\n");
+
+        fp->locals = sp - 1;
+        for (i=0; i<n; i++) PUSH (BOX(0));
+        break;
+      }
+
+      case  4: {
+        int     entry = INT, n = INT;
+        size_t *r;
+
+        SYNC;
+        r    = (size_t*) alloc (sizeof (int) * (n + 2));
+        r[0] = CLOSURE_TAG | ((n + 1) << 3);
+        r[1] = (size_t) (bf->code_ptr + entry);
+
+        for (i=0; i<n; i++) {
+          int kind = BYTE;
+
+          r[i+2] = *address (fp, kind, INT);
+        }
+
+        PUSH (r + 1);
+        break;
+      }
+
+      case  5: {
+        int     n = INT;
+        size_t  c = sp [n];
+
+        if (UNBOXED(c) || (((size_t*) c) [-1] & 7) != CLOSURE_TAG) failure ("byterun: closure expected in CALLC\n");
+        if (fp + 1 == frames + FRAMES) failure ("byterun: call stack overflow\n");
+
+        fp++;
+        fp->ip      = ip;
+        fp->base    = sp + n + 1;
+        fp->args    = sp + n - 1;
+        fp->closure = sp + n;
+        fp->func    = prof_cur;
+        fp->line    = prof_line;
+        ip          = *(char**) c;
+
+        if (prof) prof_call (ip - bf->code_ptr);
+        break;
+      }
+
+      case  6: {
+        int target = INT, n = INT;
+
+        if (fp + 1 == frames + FRAMES) failure ("byterun: call stack overflow\n");
+
+        fp++;
+        fp->ip      = ip;
+        fp->base    = sp + n;
+        fp->args    = sp + n - 1;
+        fp->closure = NULL;
+        fp->func    = prof_cur;
+        fp->line    = prof_line;
+        ip          = bf->code_ptr + target;
+
+        if (prof) prof_call (target);
+        break;
+      }
+
+      case  7: {
+        int t = tag_hash (bf, INT), n = INT;
+
+        *sp = Btag ((void*) *sp, t, BOX(n));
+        break;
+      }
+
+      case  8:
+        *sp = Barray_patt ((void*) *sp, BOX(INT));
+        break;
+
+      case  9: {
+        int line = INT, col = INT;
+
+        Bmatch_failure ((void*) *sp, fname, BOX(line), BOX(col));
+        break;
+      }
+
+      case 10: {
+        int line = INT;
+
+        if (prof) prof_set_line (line);
+        break;
+      }
+
+      default:
+        FAIL;
+      }
+      break;
+
+    case 6: {
+      void *v = (void*) *sp;
+
+      switch (l) {
+      case 0: v = (void*) POP; *sp = Bstring_patt ((void*) *sp, v); break;
+      case 1: *sp = Bstring_tag_patt  (v); break;
+      case 2: *sp = Barray_tag_patt   (v); break;
+      case 3: *sp = Bsexp_tag_patt    (v); break;
+      case 4: *sp = Bboxed_patt       (v); break;
+      case 5: *sp = Bunboxed_patt     (v); break;
+      case 6: *sp = Bclosure_tag_patt (v); break;
+      default: FAIL;
+      }
+      break;
+    }
+
+    case 7:
+      switch (l) {
+      case 0:
+        PUSH (Lread ());
+        break;
+
+      case 1:
+        *sp = Lwrite (*sp);
+        break;
+
+      case 2:
+        *sp = Llength ((void*) *sp);
+        break;
+
+      case 3:
+        SYNC;
+        *sp = (size_t) Lstring ((void*) *sp);
+        break;
+
+      case 4: {
+        int     n = INT;
+        size_t *r;
+
+        SYNC;
+        r = (size_t*) LmakeArray (BOX(n));
+        for (i=0; i<n; i++) r[i] = sp [n-1-i];
+        sp += n;
+        PUSH (r);
+        break;
+      }
+
+      default:
+        FAIL;
+      }
+      break;
+
+    default:
+      FAIL;
+    }
+  }
+  while (1);
+ stop:;
+}
+
 int main (int argc, char* argv[]) {
-  bytefile *f = read_file (argv[1]);
-  dump_file (stdout, f);
+  int       i   = 1,
+            run = 0;
+  bytefile *f;
+
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if      (strcmp  (argv[i], "-i") == 0)             run = 1;
+    else if (strcmp  (argv[i], "--profile") == 0)      run = prof = 1;
+    else if (strncmp (argv[i], "--profile=", 10) == 0) {
+      run = prof = 1;
+      prof_report = argv[i] + 10;
+    }
+    else failure ("byterun: unknown option %s\n", argv[i]);
+  }
+
+  if (i == argc) {
+    failure ("Usage: byterun [-i | --profile[=<report>]] <file> [<args>]\n"
+             "  (no option)          --- disassemble the file\n"
+             "  -i                   --- interpret the file\n"
+             "  --profile[=<report>] --- interpret the file and write the profile to report (stderr by default)\n");
+  }
+
+  f = read_file (argv[i]);
+
+  if (run) interpret (f, argv[i], argc - i, argv + i);
+  else dump_file (stdout, f);
+
   return 0;
 }
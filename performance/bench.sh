@@ -0,0 +1,159 @@
+#!/bin/sh
+
+# Runs the benchmark suite (suite/*.lama) and reports, for each benchmark in
+# each mode, the median and the 90th percentile of the wall-clock time and
+# the peak resident set size. The modes are
+#
+#   native   --- compiled by lamac
+#   bytecode --- compiled by lamac -b and run by byterun -i
+#   sm       --- run by lamac -s on the stack machine interpreter (the time
+#                includes the front-end)
+#
+# A benchmark lists the modes it supports in its "-- Modes:" line (the
+# bytecode and the stack machine can only run programs which need nothing
+# but the builtins) and its group in the "-- Group:" line. The first run of
+# each benchmark in each mode is a warm-up; its output is compared against
+# the output of the native run.
+#
+# Usage: bench.sh [-n <repetitions>] [-m "<modes>"] [-o <json file>] [<benchmark> ...]
+#
+# The results are also written as JSON (bench.json by default) for regression
+# tracking (see perfcheck.sh), one result per line. Besides the times and the
+# RSS, a result has the median CPU time (user + system, from rusage) and,
+# for the programs linked with the runtime, the median number of
+# instructions retired (when perf_event_open is available) and the GC
+# statistics of the last run (see LAMA_STATS in runtime.c); the values
+# which are not available are null.
+
+set -e
+
+cd "$(dirname "$0")"
+
+ROOT=$(cd .. && pwd)
+LAMAC=${LAMAC:-$ROOT/src/lamac}
+BYTERUN=${BYTERUN:-$ROOT/byterun/byterun}
+TIME=$(which time) || { echo "bench.sh: GNU time is required" >&2; exit 1; }
+WORK=$(pwd)/bench.tmp
+
+reps=5
+modes="native bytecode sm"
+json=bench.json
+
+while getopts n:m:o: opt; do
+  case $opt in
+    n) reps=$OPTARG ;;
+    m) modes=$OPTARG ;;
+    o) json=$OPTARG ;;
+    *) sed -n 's/^# Usage: //p' "$0" >&2; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+  set -- $(ls suite/*.lama | sed 's|suite/||; s|\.lama$||')
+fi
+
+rm -Rf "$WORK" && mkdir "$WORK"
+
+header () {
+  sed -n "s/^-- $2: *//p" "suite/$1.lama" | head -1
+}
+
+# Prints the k-th percentile (nearest rank) of the numbers on the standard input
+percentile () {
+  sort -n | awk -v k="$1" '{a[NR] = $1} END {i = int ((NR * k + 99) / 100); if (i < 1) i = 1; print a[i]}'
+}
+
+# Prints the median of the numbers given, or null
+median_of () {
+  if [ -n "$1" ]; then echo $1 | tr ' ' '\n' | percentile 50; else echo null; fi
+}
+
+# Prints a counter from the statistics of the last run, or null
+counter () {
+  if [ -f "$dir/stats" ]; then
+    awk -v k=$1 '$1 == k {v = $2} END {print v == "" ? "null" : v}' "$dir/stats"
+  else
+    echo null
+  fi
+}
+
+# Builds a benchmark for a mode in the current directory; prints the command to run it
+build () {
+  case $2 in
+    native)   LAMA=$ROOT/runtime $LAMAC -I $ROOT/stdlib -o $1 $ROOT/performance/suite/$1.lama && echo "./$1" ;;
+    bytecode) $LAMAC -I $ROOT/stdlib -b $ROOT/performance/suite/$1.lama && echo "$BYTERUN -i $1.bc" ;;
+    sm)       echo "$LAMAC -I $ROOT/stdlib -s $ROOT/performance/suite/$1.lama" ;;
+  esac
+}
+
+printf "%-14s %-12s %-9s %-10s %10s %10s %10s\n" benchmark group mode status median p90 "rss, KB"
+
+{
+  printf '{\n'
+  printf '  "version": "%s",\n' "$($LAMAC -v | head -1)"
+  printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+  printf '  "host": "%s",\n' "$(uname -n)"
+  printf '  "repetitions": %d,\n' "$reps"
+  printf '  "results": ['
+} > "$json"
+
+sep=""
+
+for b in "$@"; do
+  group=$(header $b Group)
+  supported=$(header $b Modes)
+
+  for mode in $modes; do
+    case " $supported " in *" $mode "*) ;; *) continue ;; esac
+
+    status=ok
+    times=""
+    cpus=""
+    insns=""
+    rss=0
+    dir=$WORK/$b.$mode
+    mkdir "$dir"
+
+    if ! cmd=$(cd "$dir" && build $b $mode 2> build.log); then
+      status=build-failed
+    elif ! (cd "$dir" && $cmd < /dev/null > output 2> errors); then
+      status=failed
+    elif [ -f "$WORK/$b.native/output" ] && ! cmp -s "$WORK/$b.native/output" "$dir/output"; then
+      status=mismatch
+    else
+      i=0
+      while [ $i -lt $reps ]; do
+        start=$(date +%s%N)
+        rm -f "$dir/stats"
+        (cd "$dir" && LAMA_STATS=$dir/stats $TIME -f "%M %U %S" -o rusage $cmd < /dev/null > /dev/null 2>&1) || status=failed
+        end=$(date +%s%N)
+        times="$times $(awk -v t=$((end - start)) 'BEGIN {printf "%.4f", t / 1e9}')"
+        r=$(awk 'END {print $1}' "$dir/rusage")
+        [ "$r" -gt "$rss" ] && rss=$r
+        cpus="$cpus $(awk 'END {printf "%.2f", $2 + $3}' "$dir/rusage")"
+        if [ -f "$dir/stats" ]; then
+          n=$(counter instructions)
+          [ "$n" != null ] && insns="$insns $n"
+        fi
+        i=$((i + 1))
+      done
+    fi
+
+    median=$(median_of "$times")
+    p90=$(echo $times | tr ' ' '\n' | percentile 90)
+    [ -n "$times" ] || p90=null
+    cpu=$(median_of "$cpus")
+    instructions=$(median_of "$insns")
+
+    printf "%-14s %-12s %-9s %-10s %10s %10s %10s\n" $b "$group" $mode $status $median $p90 $rss
+
+    printf '%s\n    {"benchmark": "%s", "group": "%s", "mode": "%s", "status": "%s", "median": %s, "p90": %s, "rss_kb": %d, "cpu": %s, "instructions": %s, "gc_collections": %s, "gc_allocated": %s, "gc_copied": %s, "gc_max_live": %s, "gc_time": %s, "times": [%s]}' \
+           "$sep" $b "$group" $mode $status $median $p90 $rss $cpu $instructions \
+           $(counter gc_collections) $(counter gc_allocated) $(counter gc_copied) $(counter gc_max_live) $(counter gc_time) \
+           "$(echo $times | sed 's/ /, /g')" >> "$json"
+    sep=","
+  done
+done
+
+printf '\n  ]\n}\n' >> "$json"
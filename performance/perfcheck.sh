@@ -0,0 +1,107 @@
+#!/bin/sh
+
+# Compares the results of bench.sh against a baseline recorded by bench.sh
+# and fails if any benchmark has regressed, i.e. for some
+# benchmark in some mode
+#
+#   - the baseline run succeeded and the current one did not;
+#   - the median wall-clock time grew by more than TOL_TIME percent;
+#   - the number of instructions retired grew by more than TOL_INSNS
+#     percent (when both results have it; otherwise the CPU time is compared
+#     with the TOL_TIME tolerance);
+#   - the number of words allocated, the number of collections or the
+#     maximum live data grew by more than TOL_GC percent.
+#
+# A value which was 0 in the baseline regresses when it becomes positive.
+# The benchmarks missing in either file and the values missing (null) in the
+# baseline are reported but do not fail the check. Improvements beyond the tolerances are reported as well, as a hint
+# to refresh the baseline (make perfbaseline).
+#
+# Usage: perfcheck.sh <baseline json> <current json>
+
+TOL_TIME=${TOL_TIME:-10}
+TOL_INSNS=${TOL_INSNS:-3}
+TOL_GC=${TOL_GC:-5}
+
+if [ $# -ne 2 ]; then
+  sed -n 's/^# Usage: //p' "$0" >&2
+  exit 2
+fi
+
+if [ ! -f "$1" ]; then
+  echo "perfcheck.sh: no baseline \"$1\" (record it with make perfbaseline)" >&2
+  exit 2
+fi
+
+awk -v tol_time="$TOL_TIME" -v tol_insns="$TOL_INSNS" -v tol_gc="$TOL_GC" '
+# The value of a field in a result line (bench.sh writes one per line)
+function get(line, key,    s) {
+  if (!match(line, "\"" key "\": *(\"[^\"]*\"|[^,}]*)")) return "null"
+  s = substr(line, RSTART, RLENGTH)
+  sub(/^"[^"]*": */, "", s)
+  gsub(/"/, "", s)
+  return s
+}
+
+function compare(name, what, old, new, tol,    d) {
+  if (new == "null") return
+  if (old == "null") {
+    unrecorded[what] = 1
+    return
+  }
+  if (old + 0 <= 0) {
+    if (new + 0 > 0) {
+      printf "%-26s %-14s %12s -> %-12s          REGRESSION\n", name, what, old, new
+      failed++
+    }
+    return
+  }
+  d = (new - old) * 100 / old
+  if (d > tol) {
+    printf "%-26s %-14s %12s -> %-12s %+7.1f%% REGRESSION\n", name, what, old, new, d
+    failed++
+  } else if (d < -tol)
+    printf "%-26s %-14s %12s -> %-12s %+7.1f%% improvement\n", name, what, old, new, d
+}
+
+!/"benchmark":/ {next}
+
+FNR == NR {
+  k = get($0, "benchmark") "/" get($0, "mode")
+  base[k] = $0
+  next
+}
+
+{
+  k = get($0, "benchmark") "/" get($0, "mode")
+  seen[k] = 1
+  if (!(k in base)) {
+    printf "%-26s not in the baseline\n", k
+    next
+  }
+  b = base[k]
+  if (get(b, "status") == "ok" && get($0, "status") != "ok") {
+    printf "%-26s %-14s %12s -> %-12s          REGRESSION\n", k, "status", "ok", get($0, "status")
+    failed++
+    next
+  }
+  compare(k, "median", get(b, "median"), get($0, "median"), tol_time)
+  if (get(b, "instructions") != "null" && get($0, "instructions") != "null")
+    compare(k, "instructions", get(b, "instructions"), get($0, "instructions"), tol_insns)
+  else
+    compare(k, "cpu", get(b, "cpu"), get($0, "cpu"), tol_time)
+  compare(k, "gc_allocated", get(b, "gc_allocated"), get($0, "gc_allocated"), tol_gc)
+  compare(k, "gc_collections", get(b, "gc_collections"), get($0, "gc_collections"), tol_gc)
+  compare(k, "gc_max_live", get(b, "gc_max_live"), get($0, "gc_max_live"), tol_gc)
+}
+
+END {
+  for (k in base) if (!(k in seen)) printf "%-26s not run\n", k
+  for (w in unrecorded) printf "%-26s not gated (null in the baseline)\n", w
+  if (failed) {
+    printf "%d regression(s)\n", failed
+    exit 1
+  }
+  print "no regressions"
+}
+' "$1" "$2"
@@ -1,6 +1,8 @@
 F,assert;
 F,getEnv;
 F,system;
+F,spawn;
+F,join;
 V,sysargs;
 F,stringInt;
 F,makeArray;
@@ -18,6 +20,11 @@ F,matchSubString;
 F,substring;
 F,regexp;
 F,regexpMatch;
+F,makeMatcher;
+F,matcherString;
+F,matcherRegexp;
+F,matcherLine;
+F,matcherCol;
 F,sprintf;
 F,makeString;
 F,printf;
@@ -27,10 +34,29 @@ F,fclose;
 F,fread;
 F,fwrite;
 F,fexists;
+F,freadLine;
+F,freadChunk;
+F,fwriteString;
+F,fflush;
+F,fmap;
 F,failure;
 F,read;
 F,write;
 F,compare;
+F,makeHashTab;
+F,hashTabGet;
+F,hashTabPut;
+F,hashTabChains;
+F,sortArray;
+F,arrayBlit;
+F,arrayFill;
+F,arraySub;
+F,arrayAppend;
+F,arrayInit;
+F,arrayMap;
+F,bytesBlit;
+F,bytesGetInt;
+F,bytesSetInt;
 F,i__Infix_4343;
 F,s__Infix_58;
 F,s__Infix_3333;
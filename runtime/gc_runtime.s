@@ -4,8 +4,19 @@ printf_format2:		.string	"BOT: %lx\n"
 printf_format3:		.string	"TOP: %lx\n"
 printf_format4:		.string	"EAX: %lx\n"
 printf_format5:		.string	"LOL\n"
-__gc_stack_bottom:	.long	0
-__gc_stack_top:	        .long	0
+
+	// the stack bounds are thread-local: each thread (task)
+	// collects garbage in its own heap and scans its own stack
+			.section .tbss,"awT",@nobits
+			.align	4
+			.type	__gc_stack_bottom, @object
+			.size	__gc_stack_bottom, 4
+__gc_stack_bottom:	.zero	4
+			.type	__gc_stack_top, @object
+			.size	__gc_stack_top, 4
+__gc_stack_top:	        .zero	4
+
+			.data
 
 			.globl	__pre_gc
 			.globl	__post_gc
@@ -13,12 +24,15 @@ __gc_stack_top:	        .long	0
 			.globl	__gc_root_scan_stack
 			.globl	__gc_stack_top
 			.globl	__gc_stack_bottom
+			.globl	__call_closure0
+			.globl	__call_closure1
+			.globl	__call_closure2
 			.extern	init_pool
 			.extern	gc_test_and_copy_root
 			.text
 
-__gc_init:		movl	%ebp, __gc_stack_bottom
-			addl	$4, __gc_stack_bottom
+__gc_init:		movl	%ebp, %gs:__gc_stack_bottom@ntpoff
+			addl	$4, %gs:__gc_stack_bottom@ntpoff
 			call	__init
 			ret
 
@@ -27,12 +41,12 @@ __gc_init:		movl	%ebp, __gc_stack_bottom
 	// else return
 __pre_gc:
 			pushl	%eax
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			cmpl	$0, %eax
 			jne	__pre_gc_2
 			movl	%ebp, %eax
 			// addl	$8, %eax
-			movl	%eax, __gc_stack_top
+			movl	%eax, %gs:__gc_stack_top@ntpoff
 __pre_gc_2:
 			popl	%eax
 			ret
@@ -43,10 +57,10 @@ __pre_gc_2:
 	// else return
 __post_gc:
 			pushl	%eax
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			cmpl	%eax, %ebp
 			jnz	__post_gc2
-			movl	$0, __gc_stack_top
+			movl	$0, %gs:__gc_stack_top@ntpoff
 __post_gc2:
 			popl	%eax
 			ret
@@ -59,7 +73,7 @@ __gc_root_scan_stack:
 			movl	%esp, %ebp
 			pushl	%ebx
 			pushl	%edx
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			jmp 	next
 
 loop:
@@ -83,12 +97,12 @@ check12:
 	// i.e. the following is not true:
 	// __gc_stack_bottom <= (%eax) <= __gc_stack_top
 check21:	
-			cmpl	%ebx, __gc_stack_top
+			cmpl	%ebx, %gs:__gc_stack_top@ntpoff
 			jna	check22
 			jmp	loop2
 
 check22:
-			cmpl	%ebx, __gc_stack_bottom
+			cmpl	%ebx, %gs:__gc_stack_bottom@ntpoff
 			jnb	next
 
 	// check if it a valid pointer
@@ -105,7 +119,7 @@ gc_run_t:
 
 next:
 			addl	$4, %eax
-			cmpl	%eax, __gc_stack_bottom
+			cmpl	%eax, %gs:__gc_stack_bottom@ntpoff
 			jne	loop
 returnn:
 			movl	$0, %eax
@@ -114,3 +128,56 @@ returnn:
 			movl	%ebp, %esp 
 			popl	%ebp
 			ret
+
+	// Call a closure with no/one/two arguments from C code:
+	// int __call_closure0 (void *closure)
+	// int __call_closure1 (void *closure, void *x)
+	// int __call_closure2 (void *closure, void *x, void *y)
+	// The code of a closure takes the closure itself in %edx and
+	// may clobber all the registers but %ebp and %esp
+__call_closure0:
+			pushl	%ebp
+			movl	%esp, %ebp
+			pushl	%ebx
+			pushl	%esi
+			pushl	%edi
+			movl	8(%ebp), %edx
+			call	*(%edx)
+			popl	%edi
+			popl	%esi
+			popl	%ebx
+			popl	%ebp
+			ret
+
+__call_closure1:
+			pushl	%ebp
+			movl	%esp, %ebp
+			pushl	%ebx
+			pushl	%esi
+			pushl	%edi
+			pushl	12(%ebp)
+			movl	8(%ebp), %edx
+			call	*(%edx)
+			addl	$4, %esp
+			popl	%edi
+			popl	%esi
+			popl	%ebx
+			popl	%ebp
+			ret
+
+__call_closure2:
+			pushl	%ebp
+			movl	%esp, %ebp
+			pushl	%ebx
+			pushl	%esi
+			pushl	%edi
+			pushl	16(%ebp)
+			pushl	12(%ebp)
+			movl	8(%ebp), %edx
+			call	*(%edx)
+			addl	$8, %esp
+			popl	%edi
+			popl	%esi
+			popl	%ebx
+			popl	%ebp
+			ret
@@ -19,9 +19,10 @@ void print_indent (void) {
 }
 #endif
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern __thread size_t __gc_stack_top, __gc_stack_bottom;
 
-/* GC pool structure and data; declared here in order to allow debug print */
+/* GC pool structure and data; declared here in order to allow debug print.
+   Each thread (see spawn) has its own heap, thus the pools are thread-local */
 typedef struct {
   size_t * begin;
   size_t * end;
@@ -29,11 +30,17 @@ typedef struct {
   size_t   size;
 } pool;
 
-static pool from_space;
-static pool to_space;
-size_t      *current;
+static __thread pool from_space;
+static __thread pool to_space;
+__thread size_t     *current;
 /* end */
 
+/* The state shared by the threads of the tasks (the cache of regexps, the
+   memory-mapped strings, the statistics and the allocation profile) is
+   protected by runtime_lock; it is recursive, since a failure under the lock
+   runs the exit handlers, which may take it again */
+static pthread_mutex_t runtime_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 # ifdef __ENABLE_GC__
 
 /* GC extern invariant for built-in functions */
@@ -62,6 +69,15 @@ void __post_gc_subst () {}
 
 # define TO_DATA(x) ((data*)((char*)(x)-sizeof(int)))
 # define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(int)))
+
+/* Allocation profiling: ALLOC_PROF(x) accounts for a freshly created object
+   x in the runtime built with LAMA_ALLOC_PROF (see alloc_prof_record) */
+# ifdef LAMA_ALLOC_PROF
+static void alloc_prof_record (void *p);
+#   define ALLOC_PROF(x) alloc_prof_record (x)
+# else
+#   define ALLOC_PROF(x)
+# endif
 # ifdef DEBUG_PRINT // GET_SEXP_TAG is necessary for printing from space
 # define GET_SEXP_TAG(x) (LEN(x))
 #endif
@@ -77,7 +93,7 @@ typedef struct {
   void ** roots[MAX_EXTRA_ROOTS_NUMBER];
 } extra_roots_pool;
 
-static extra_roots_pool extra_roots;
+static __thread extra_roots_pool extra_roots;
 
 void clear_extra_roots (void) {
   extra_roots.current_free = 0;
@@ -363,7 +379,7 @@ extern int LtagHash (char *s) {
 
 char* de_hash (int n) {
   //  static char *chars = (char*) BOX (NULL);
-  static char buf[6] = {0,0,0,0,0,0};
+  static __thread char buf[6] = {0,0,0,0,0,0};
   char *p = (char *) BOX (NULL);
   p = &buf[5];
 
@@ -396,28 +412,74 @@ typedef struct {
   int len;  
 } StringBuf;
 
-static StringBuf stringBuf;
+/* The formatting buffer is allocated once (per thread) and reused by all
+   formatting primitives; "createStringBuf" only resets it, and
+   "deleteStringBuf" releases it only if it has grown too large to be kept
+   around */
+static __thread StringBuf stringBuf;
 
 # define STRINGBUF_INIT 128
+# define STRINGBUF_KEEP (64 * 1024)
 
 static void createStringBuf () {
-  stringBuf.contents = (char*) malloc (STRINGBUF_INIT);
-  stringBuf.ptr      = 0;
-  stringBuf.len      = STRINGBUF_INIT;
+  if (stringBuf.contents == NULL) {
+    stringBuf.contents = (char*) malloc (STRINGBUF_INIT);
+    stringBuf.len      = STRINGBUF_INIT;
+  }
+
+  stringBuf.ptr         = 0;
+  stringBuf.contents[0] = 0;
 }
 
 static void deleteStringBuf () {
-  free (stringBuf.contents);
+  if (stringBuf.len > STRINGBUF_KEEP) {
+    free (stringBuf.contents);
+    stringBuf.contents = NULL;
+    stringBuf.len      = 0;
+  }
+
+  stringBuf.ptr = 0;
 }
 
-static void extendStringBuf () {
+// Extends the buffer to hold at least n characters
+static void extendStringBuf (int n) {
   int len = stringBuf.len << 1;
 
+  while (len < n) len <<= 1;
+
   stringBuf.contents = (char*) realloc (stringBuf.contents, len);
   stringBuf.len      = len;
 }
 
-static void vprintStringBuf (char *fmt, va_list args) {
+static void appendStringBuf (char *s, int n) {
+  if (stringBuf.ptr + n >= stringBuf.len) extendStringBuf (stringBuf.ptr + n + 1);
+
+  memcpy (&stringBuf.contents[stringBuf.ptr], s, n);
+  stringBuf.ptr += n;
+  stringBuf.contents[stringBuf.ptr] = 0;
+}
+
+static void appendCStringBuf (char *s) {
+  appendStringBuf (s, strlen (s));
+}
+
+static void appendIntStringBuf (int n) {
+  char     buf [16], *p = &buf [16];
+  unsigned u = n < 0 ? - (unsigned) n : (unsigned) n;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  if (n < 0) *--p = '-';
+
+  appendStringBuf (p, &buf [16] - p);
+}
+
+// Formats with vsnprintf; the output is retried at most once, with the
+// buffer extended to the exact size required
+static void vformatStringBuf (char *fmt, va_list args) {
   int     written = 0,
           rest    = 0;
   char   *buf     = (char*) BOX(NULL);
@@ -434,7 +496,7 @@ static void vprintStringBuf (char *fmt, va_list args) {
   va_end(vsnargs);
   
   if (written >= rest) {
-    extendStringBuf ();
+    extendStringBuf (stringBuf.ptr + written + 1);
     goto again;
   }
 
@@ -445,7 +507,115 @@ static void printStringBuf (char *fmt, ...) {
   va_list args;
 
   va_start (args, fmt);
-  vprintStringBuf (fmt, args);
+  vformatStringBuf (fmt, args);
+  va_end (args);
+}
+
+// Skips flags, width and precision of a directive; returns NULL if the
+// directive can not be handled by vprintStringBuf itself
+static char* simpleDirective (char *p) {
+  while (*p && strchr ("-+ #0", *p)) p++;
+  while (isdigit (*p)) p++;
+
+  if (*p == '.') {
+    p++;
+    while (isdigit (*p)) p++;
+  }
+
+  return *p && strchr ("diouxXcs", *p) ? p : NULL;
+}
+
+// Checks if all the directives of fmt are simple enough
+static int simpleFormat (char *fmt) {
+  char *p = fmt;
+
+  while ((p = strchr (p, '%')) != NULL) {
+    if (p[1] == '%') p += 2;
+    else {
+      char *e = simpleDirective (p+1);
+
+      if (e == NULL || e - p >= 30) return 0;
+
+      p = e + 1;
+    }
+  }
+
+  return 1;
+}
+
+// Formats into the buffer. Integer, character and string directives
+// without modifiers are written directly; other simple directives are
+// formatted one by one; formats with anything else are left to vsnprintf
+static void vprintStringBuf (char *fmt, va_list args) {
+  char *p = fmt, *q;
+
+  if (! simpleFormat (fmt)) {
+    vformatStringBuf (fmt, args);
+    return;
+  }
+
+  for (;;) {
+    for (q = p; *q && *q != '%'; q++);
+
+    appendStringBuf (p, q - p);
+
+    if (*q == 0) return;
+
+    switch (*++q) {
+    case '%':
+      appendStringBuf ("%", 1);
+      break;
+
+    case 'd':
+    case 'i':
+      appendIntStringBuf (va_arg (args, int));
+      break;
+
+    case 's': {
+      char *s = va_arg (args, char*);
+
+      appendCStringBuf (s ? s : "(null)");
+      break;
+    }
+
+    case 'c': {
+      char c = (char) va_arg (args, int);
+
+      appendStringBuf (&c, 1);
+      break;
+    }
+
+    default: {
+      char  spec [32];
+      char *e = simpleDirective (q);
+      int   n = e - q + 2;
+
+      spec [0] = '%';
+      memcpy (&spec [1], q, n - 1);
+      spec [n] = 0;
+
+      printStringBuf (spec, va_arg (args, int));
+      q = e;
+    }
+    }
+
+    p = q + 1;
+  }
+}
+
+// Copies the contents of the buffer into a fresh string
+static void* stringBufString () {
+  extern void* LmakeString (int);
+  void *s;
+
+  __pre_gc ();
+
+  s = LmakeString (BOX(stringBuf.ptr));
+  memcpy (s, stringBuf.contents, stringBuf.ptr + 1);
+
+  __post_gc ();
+
+  return s;
 }
 
 int is_valid_heap_pointer (void *p);
@@ -453,7 +623,7 @@ int is_valid_heap_pointer (void *p);
 static void printValue (void *p) {
   data *a = (data*) BOX(NULL);
   int i   = BOX(0);
-  if (UNBOXED(p)) printStringBuf ("%d", UNBOX(p));
+  if (UNBOXED(p)) appendIntStringBuf (UNBOX(p));
   else {
     if (! is_valid_heap_pointer(p)) {
       printStringBuf ("0x%x", p);
@@ -464,27 +634,29 @@ static void printValue (void *p) {
 
     switch (TAG(a->tag)) {      
     case STRING_TAG:
-      printStringBuf ("\"%s\"", a->contents);
+      appendStringBuf ("\"", 1);
+      appendCStringBuf (a->contents);
+      appendStringBuf ("\"", 1);
       break;
 
     case CLOSURE_TAG:
-      printStringBuf ("<closure ");
+      appendCStringBuf ("<closure ");
       for (i = 0; i < LEN(a->tag); i++) {
 	if (i) printValue ((void*)((int*) a->contents)[i]);
 	else printStringBuf ("0x%x", (void*)((int*) a->contents)[i]);
 	
-	if (i != LEN(a->tag) - 1) printStringBuf (", ");
+	if (i != LEN(a->tag) - 1) appendStringBuf (", ", 2);
       }
-      printStringBuf (">");
+      appendStringBuf (">", 1);
       break;
       
     case ARRAY_TAG:
-      printStringBuf ("[");
+      appendStringBuf ("[", 1);
       for (i = 0; i < LEN(a->tag); i++) {
         printValue ((void*)((int*) a->contents)[i]);
-	if (i != LEN(a->tag) - 1) printStringBuf (", ");
+	if (i != LEN(a->tag) - 1) appendStringBuf (", ", 2);
       }
-      printStringBuf ("]");
+      appendStringBuf ("]", 1);
       break;
       
     case SEXP_TAG: {
@@ -497,29 +669,29 @@ static void printValue (void *p) {
       if (strcmp (tag, "cons") == 0) {
 	data *b = a;
 	
-	printStringBuf ("{");
+	appendStringBuf ("{", 1);
 
 	while (LEN(a->tag)) {
 	  printValue ((void*)((int*) b->contents)[0]);
 	  b = (data*)((int*) b->contents)[1];
 	  if (! UNBOXED(b)) {
-	    printStringBuf (", ");
+	    appendStringBuf (", ", 2);
 	    b = TO_DATA(b);
 	  }
 	  else break;
 	}
 	
-	printStringBuf ("}");
+	appendStringBuf ("}", 1);
       }
       else {
-	printStringBuf ("%s", tag);
+	appendCStringBuf (tag);
 	if (LEN(a->tag)) {
-	  printStringBuf (" (");
+	  appendStringBuf (" (", 2);
 	  for (i = 0; i < LEN(a->tag); i++) {
 	    printValue ((void*)((int*) a->contents)[i]);
-	    if (i != LEN(a->tag) - 1) printStringBuf (", ");
+	    if (i != LEN(a->tag) - 1) appendStringBuf (", ", 2);
 	  }
-	  printStringBuf (")");
+	  appendStringBuf (")", 1);
 	}
       }
     }
@@ -541,7 +713,7 @@ static void stringcat (void *p) {
 
     switch (TAG(a->tag)) {      
     case STRING_TAG:
-      printStringBuf ("%s", a->contents);
+      appendCStringBuf (a->contents);
       break;
       
     case SEXP_TAG: {
@@ -572,6 +744,74 @@ static void stringcat (void *p) {
   }
 }
 
+// Computes the length of the string "stringcat" builds for p; returns -1
+// if p contains anything but strings and lists thereof (the result then
+// contains error messages and is built by printing)
+static int stringcat_length (void *p) {
+  data *a;
+  int   n = 0, m;
+
+  if (UNBOXED(p)) return 0;
+
+  a = TO_DATA(p);
+
+  switch (TAG(a->tag)) {
+  case STRING_TAG:
+    return LEN(a->tag);
+
+  case SEXP_TAG: {
+#ifndef DEBUG_PRINT
+    char * tag = de_hash (TO_SEXP(p)->tag);
+#else
+    char * tag = de_hash (GET_SEXP_TAG(TO_SEXP(p)->tag));
+#endif
+    data * b   = a;
+
+    if (strcmp (tag, "cons") != 0) return -1;
+
+    while (LEN(a->tag)) {
+      if ((m = stringcat_length ((void*)((int*) b->contents)[0])) < 0) return -1;
+      n += m;
+      b = (data*)((int*) b->contents)[1];
+      if (! UNBOXED(b)) b = TO_DATA(b);
+      else break;
+    }
+
+    return n;
+  }
+
+  default:
+    return -1;
+  }
+}
+
+// Copies the strings of p (as accepted by stringcat_length) to dst;
+// returns the position right after the last copied character
+static char* stringcat_copy (char *dst, void *p) {
+  data *a;
+
+  if (UNBOXED(p)) return dst;
+
+  a = TO_DATA(p);
+
+  if (TAG(a->tag) == STRING_TAG) {
+    memcpy (dst, a->contents, LEN(a->tag));
+    return dst + LEN(a->tag);
+  }
+  else {
+    data *b = a;
+
+    while (LEN(a->tag)) {
+      dst = stringcat_copy (dst, (void*)((int*) b->contents)[0]);
+      b = (data*)((int*) b->contents)[1];
+      if (! UNBOXED(b)) b = TO_DATA(b);
+      else break;
+    }
+
+    return dst;
+  }
+}
+
 extern int Luppercase (void *v) {
   ASSERT_UNBOXED("Luppercase:1", v);
   return BOX(toupper ((int) UNBOX(v)));
@@ -617,7 +857,10 @@ extern void* Lsubstring (void *subj, int p, int l) {
 
     r->tag = STRING_TAG | (ll << 3);
 
-    strncpy (r->contents, (char*) subj + pp, ll);
+    memcpy (r->contents, (char*) subj + pp, ll);
+    r->contents[ll] = 0;
+
+    ALLOC_PROF (r->contents);
     
     __post_gc ();
 
@@ -628,190 +871,699 @@ extern void* Lsubstring (void *subj, int p, int l) {
             subject length=%d)", pp, ll, LEN(d->tag));
 }
 
-extern struct re_pattern_buffer *Lregexp (char *regexp) {
-  regex_t *b = (regex_t*) malloc (sizeof (regex_t));
+/* Byte-level access to strings. Strings carry their length in the header
+   and may contain arbitrary bytes (zeros included), thus they serve as byte
+   sequences as well (see unit Bytes). */
 
-  memset (b, 0, sizeof (regex_t));
-  
-  int n = (int) re_compile_pattern (regexp, strlen (regexp), b);
-  
-  if (n != 0) {
-    failure ("%", strerror (n));
-  };
+static void bytes_range (char *name, void *s, int pos, int len) {
+  int n = LEN(TO_DATA(s)->tag);
 
-  return b;
+  if (pos < 0 || len < 0 || pos > n - len)
+    failure ("%s: range %d..%d out of bounds (length %d)\n", name, pos, pos + len, n);
 }
 
-extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
-  int res;
-  
-  ASSERT_BOXED("regexpMatch:1", b);
-  ASSERT_STRING("regexpMatch:2", s);
-  ASSERT_UNBOXED("regexpMatch:3", pos);
+extern void* LbytesBlit (void *src, int sp, void *dst, int dp, int len) {
+  ASSERT_STRING("bytesBlit:1", src);
+  ASSERT_UNBOXED("bytesBlit:2", sp);
+  ASSERT_STRING("bytesBlit:3", dst);
+  ASSERT_UNBOXED("bytesBlit:4", dp);
+  ASSERT_UNBOXED("bytesBlit:5", len);
 
-  res = re_match (b, s, LEN(TO_DATA(s)->tag), UNBOX(pos), 0);
+  bytes_range ("bytesBlit", src, UNBOX(sp), UNBOX(len));
+  bytes_range ("bytesBlit", dst, UNBOX(dp), UNBOX(len));
 
-  if (res) {
-    return BOX (res);
-  }
+  memmove ((char*) dst + UNBOX(dp), (char*) src + UNBOX(sp), UNBOX(len));
 
-  return BOX (res);
+  return dst;
 }
 
-extern void* Bstring (void*);
+/* Reads an integer of 1..4 bytes in little- or big-endian order; values of
+   less than 4 bytes are unsigned, 4-byte ones are signed and truncated to
+   the range of integers */
+extern int LbytesGetInt (void *s, int pos, int width, int big) {
+  unsigned char *p;
+  unsigned       v = 0;
+  int            w = UNBOX(width), i;
 
-void *Lclone (void *p) {
-  data *obj;
-  sexp *sobj;
-  void* res;
-  int n;
-#ifdef DEBUG_PRINT
-  register int * ebp asm ("ebp");
-  indent++; print_indent ();
-  printf ("Lclone arg: %p %p\n", &p, p); fflush (stdout);
-#endif
-  __pre_gc ();
-  
-  if (UNBOXED(p)) return p;
-  else {
-    data *a = TO_DATA(p);
-    int t   = TAG(a->tag), l = LEN(a->tag);
+  ASSERT_STRING("bytesGetInt:1", s);
+  ASSERT_UNBOXED("bytesGetInt:2", pos);
+  ASSERT_UNBOXED("bytesGetInt:3", width);
+  ASSERT_UNBOXED("bytesGetInt:4", big);
 
-    push_extra_root (&p);
-    switch (t) {
-    case STRING_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: string1 &p=%p p=%p\n", &p, p); fflush (stdout);
-#endif
-      res = Bstring (TO_DATA(p)->contents);
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: string2 %p %p\n", &p, p); fflush (stdout);
-#endif
-      break;
+  if (w < 1 || w > 4) failure ("bytesGetInt: invalid width %d\n", w);
 
-    case ARRAY_TAG:      
-    case CLOSURE_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
-#endif
-      obj = (data*) alloc (sizeof(int) * (l+1));
-      memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
-      res = (void*) (obj->contents);
-      break;
-      
-    case SEXP_TAG:
-#ifdef DEBUG_PRINT
-      print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
-#endif
-      sobj = (sexp*) alloc (sizeof(int) * (l+2));
-      memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
-      res = (void*) sobj->contents.contents;
-      break;
-       
-    default:
-      failure ("invalid tag %d in clone *****\n", t);
-    }
-    pop_extra_root (&p);
-  }
-#ifdef DEBUG_PRINT
-  print_indent (); printf ("Lclone ends1\n"); fflush (stdout);
-#endif
+  bytes_range ("bytesGetInt", s, UNBOX(pos), w);
 
-  __post_gc ();
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("Lclone ends2\n"); fflush (stdout);
-  indent--;
-#endif
-  return res;
+  p = (unsigned char*) s + UNBOX(pos);
+
+  for (i = 0; i < w; i++) v = (v << 8) | p[UNBOX(big) ? i : w - 1 - i];
+
+  return BOX((int) v);
 }
 
-# define HASH_DEPTH 3
-# define HASH_APPEND(acc, x) (((acc + (unsigned) x) << (WORD_SIZE / 2)) | ((acc + (unsigned) x) >> (WORD_SIZE / 2)))
+extern void* LbytesSetInt (void *s, int pos, int width, int big, int x) {
+  unsigned char *p;
+  unsigned       v = (unsigned) UNBOX(x);
+  int            w = UNBOX(width), i;
 
-int inner_hash (int depth, unsigned acc, void *p) {
-  if (depth > HASH_DEPTH) return acc;
+  ASSERT_STRING("bytesSetInt:1", s);
+  ASSERT_UNBOXED("bytesSetInt:2", pos);
+  ASSERT_UNBOXED("bytesSetInt:3", width);
+  ASSERT_UNBOXED("bytesSetInt:4", big);
+  ASSERT_UNBOXED("bytesSetInt:5", x);
 
-  if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
-  else if (is_valid_heap_pointer (p)) {
-    data *a = TO_DATA(p);
-    int t = TAG(a->tag), l = LEN(a->tag), i;
+  if (w < 1 || w > 4) failure ("bytesSetInt: invalid width %d\n", w);
 
-    acc = HASH_APPEND(acc, t);
-    acc = HASH_APPEND(acc, l);    
+  bytes_range ("bytesSetInt", s, UNBOX(pos), w);
 
-    switch (t) {
-    case STRING_TAG: {
-      char *p = a->contents;
+  p = (unsigned char*) s + UNBOX(pos);
 
-      while (*p) {
-        int n = (int) *p++;
-	acc = HASH_APPEND(acc, n);
-      }
+  for (i = 0; i < w; i++, v >>= 8) p[UNBOX(big) ? w - 1 - i : i] = v & 0xff;
 
-      return acc;
-    }
-      
-    case CLOSURE_TAG:
-      acc = HASH_APPEND(acc, ((void**) a->contents)[0]);
-      i = 1;
-      break;
-      
-    case ARRAY_TAG:
-      i = 0;
-      break;
+  return s;
+}
 
-    case SEXP_TAG: {
-#ifndef DEBUG_PRINT
-      int ta = TO_SEXP(p)->tag;
-#else
-      int ta = GET_SEXP_TAG(TO_SEXP(p)->tag);
-#endif
-      acc = HASH_APPEND(acc, ta);
-      i = 0;
-      break;
-    }
+/* Regular expressions.
 
-    default:
-      failure ("invalid tag %d in hash *****\n", t);
-    }
+   Compiled expressions are cached by their textual representation, so
+   repeated calls to "regexp" with the same pattern share one pattern
+   buffer; the cache owns the buffers and releases them at exit.
+
+   Expressions of the shape "C", "C*", "C+" and "C1C2*", where C, C1 and
+   C2 are either bracket expressions, ordinary characters or ".", are
+   additionally compiled into character-class tables and matched without
+   calling re_match. For such expressions greedy matching coincides with
+   the longest match, thus the results are the same.
+*/
+
+# define REGEXP_GENERIC 0
+# define REGEXP_CLASSES 1
+
+# define REGEXP_CACHE_SIZE 256
+
+typedef struct regexp_entry {
+  struct re_pattern_buffer buf;   // must go first: entries are passed around
+                                  // as pattern buffers
+  int                      kind;
+  int                      has_first;
+  unsigned char            first [UCHAR_MAX + 1];
+  unsigned char            rest  [UCHAR_MAX + 1];
+  char                    *pattern;
+  struct regexp_entry     *next;
+} regexp_entry;
 
-    for (; i<l; i++) 
-      acc = inner_hash (depth+1, acc, ((void**) a->contents)[i]);
+static regexp_entry *regexp_cache [REGEXP_CACHE_SIZE];
+static int           regexp_cache_registered = 0;
 
-    return acc;
+static unsigned regexp_hash (char *s) {
+  unsigned h = 2166136261u;
+
+  while (*s) {
+    h ^= (unsigned char) *s++;
+    h *= 16777619u;
   }
-  else return HASH_APPEND(acc, p);
-}
 
-extern void* LstringInt (char *b) {
-  int n;
-  sscanf (b, "%d", &n);
-  return (void*) BOX(n);
+  return h % REGEXP_CACHE_SIZE;
 }
 
-extern int Lhash (void *p) {
-  return BOX(0x3fffff & inner_hash (0, 0, p));
-}
+static void regexp_cache_free (void) {
+  int i;
 
-extern int LflatCompare (void *p, void *q) {
-  if (UNBOXED(p)) {
-    if (UNBOXED(q)) {
-      return BOX (UNBOX(p) - UNBOX(q));
+  for (i = 0; i < REGEXP_CACHE_SIZE; i++) {
+    regexp_entry *e = regexp_cache [i];
+
+    while (e) {
+      regexp_entry *n = e->next;
+
+      regfree (&e->buf);
+      free    (e->pattern);
+      free    (e);
+
+      e = n;
     }
-    
-    return -1;
+
+    regexp_cache [i] = NULL;
   }
-  else if (~UNBOXED(q)) {
-    return BOX(p - q);
+}
+
+// Parses a single character class at *s into set; returns 0 if the
+// class is not simple enough to be handled by the fast path
+static int regexp_parse_class (char **s, unsigned char *set) {
+  char *p = *s;
+  int   negate = 0, i;
+
+  memset (set, 0, UCHAR_MAX + 1);
+
+  switch (*p) {
+  case '.':
+    memset (set, 1, UCHAR_MAX + 1);
+    set ['\n'] = 0;
+    *s = p + 1;
+    return 1;
+
+  case '[':
+    p++;
+
+    if (*p == '^') {
+      negate = 1;
+      p++;
+    }
+
+    if (*p == ']') {
+      set [']'] = 1;
+      p++;
+    }
+
+    while (*p != ']') {
+      unsigned char from, to;
+
+      if (*p == 0 || *p == '[') return 0;
+
+      from = to = (unsigned char) *p++;
+
+      if (*p == '-' && p[1] != ']' && p[1] != 0) {
+        to = (unsigned char) p[1];
+        p += 2;
+      }
+
+      for (i = from; i <= to; i++) set [i] = 1;
+    }
+
+    if (negate)
+      for (i = 0; i <= UCHAR_MAX; i++) set [i] = !set [i];
+
+    *s = p + 1;
+    return 1;
+
+  case 0  : case '\\': case '*': case '+':
+  case '?': case '^' : case '$': case ']':
+    return 0;
+
+  default:
+    set [(unsigned char) *p] = 1;
+    *s = p + 1;
+    return 1;
   }
-  else BOX(1);
 }
 
-extern int Lcompare (void *p, void *q) {
+static void regexp_classify (regexp_entry *e) {
+  unsigned char c [UCHAR_MAX + 1];
+  char *p = e->pattern;
+
+  e->kind = REGEXP_GENERIC;
+
+  if (! regexp_parse_class (&p, c)) return;
+
+  switch (*p) {
+  case 0:
+    memcpy (e->first, c, UCHAR_MAX + 1);
+    memset (e->rest , 0, UCHAR_MAX + 1);
+    e->has_first = 1;
+    break;
+
+  case '*':
+    if (p[1]) return;
+    memcpy (e->rest, c, UCHAR_MAX + 1);
+    e->has_first = 0;
+    break;
+
+  case '+':
+    if (p[1]) return;
+    memcpy (e->first, c, UCHAR_MAX + 1);
+    memcpy (e->rest , c, UCHAR_MAX + 1);
+    e->has_first = 1;
+    break;
+
+  default:
+    memcpy (e->first, c, UCHAR_MAX + 1);
+    if (! regexp_parse_class (&p, e->rest)) return;
+    if (p[0] != '*' || p[1]) return;
+    e->has_first = 1;
+  }
+
+  e->kind = REGEXP_CLASSES;
+}
+
+extern struct re_pattern_buffer *Lregexp (char *regexp) {
+  unsigned      h = 0;
+  regexp_entry *e = NULL;
+  const char   *err;
+
+  ASSERT_STRING("regexp:1", regexp);
+
+  h = regexp_hash (regexp);
+
+  pthread_mutex_lock (&runtime_lock);
+
+  for (e = regexp_cache [h]; e; e = e->next)
+    if (strcmp (e->pattern, regexp) == 0) {
+      pthread_mutex_unlock (&runtime_lock);
+      return &e->buf;
+    }
+
+  e = (regexp_entry*) malloc (sizeof (regexp_entry));
+
+  if (e == NULL) {
+    pthread_mutex_unlock (&runtime_lock);
+    failure ("regexp: out of memory\n");
+  }
+
+  memset (e, 0, sizeof (regexp_entry));
+
+  err = re_compile_pattern (regexp, strlen (regexp), &e->buf);
+
+  if (err != NULL) {
+    free (e);
+    pthread_mutex_unlock (&runtime_lock);
+    failure ("regexp (\"%s\"): %s\n", regexp, err);
+  }
+
+  e->pattern = strdup (regexp);
+  regexp_classify (e);
+
+  e->next = regexp_cache [h];
+  regexp_cache [h] = e;
+
+  if (! regexp_cache_registered) {
+    atexit (regexp_cache_free);
+    regexp_cache_registered = 1;
+  }
+
+  pthread_mutex_unlock (&runtime_lock);
+
+  return &e->buf;
+}
+
+extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
+  regexp_entry *e = (regexp_entry*) b;
+  int i, n;
+
+  ASSERT_BOXED("regexpMatch:1", b);
+  ASSERT_STRING("regexpMatch:2", s);
+  ASSERT_UNBOXED("regexpMatch:3", pos);
+
+  n = LEN(TO_DATA(s)->tag);
+  i = UNBOX(pos);
+
+  if (e->kind == REGEXP_CLASSES) {
+    unsigned char *u = (unsigned char*) s;
+
+    if (e->has_first) {
+      if (i < n && e->first [u[i]]) i++;
+      else return BOX (-1);
+    }
+
+    while (i < n && e->rest [u[i]]) i++;
+
+    return BOX (i - UNBOX(pos));
+  }
+
+  return BOX (re_match (b, s, n, i, 0));
+}
+
+/* Matchers.
+
+   A matcher is an immutable array [buf, pos, lines], where buf is the string
+   being matched, pos is the current position in it, and lines is a string
+   holding, as raw integers, the number of lines of buf, the offsets of the
+   beginnings of the lines and the offsets of the tabs in buf. The index is
+   built once per buffer and shared by all its matchers, so a successful
+   match allocates a single three-element array, while the line and the
+   column of a matcher are computed on demand by binary searches over the
+   index, in logarithmic time. */
+
+extern void* LmakeString (int length);
+extern void* LmakeArray  (int length);
+
+extern void* LmakeMatcher (void *buf) {
+  void *lines, *m;
+  int   n, k = 1, t = 0, i, *l, *tabs;
+  char *b;
+
+  ASSERT_STRING("makeMatcher:1", buf);
+
+  n = LEN(TO_DATA(buf)->tag);
+  b = (char*) buf;
+
+  for (i = 0; i < n; i++) {
+    k += b[i] == '\n';
+    t += b[i] == '\t';
+  }
+
+  __pre_gc ();
+
+  push_extra_root (&buf);
+  lines = LmakeString (BOX((1 + k + t) * sizeof (int)));
+  push_extra_root (&lines);
+  m = LmakeArray (BOX(3));
+  pop_extra_root (&lines);
+  pop_extra_root (&buf);
+
+  b    = (char*) buf;
+  l    = (int*) lines;
+  tabs = l + 1 + k;
+  l[0] = k;
+  l[1] = 0;
+
+  for (i = 0, k = 2, t = 0; i < n; i++)
+    if (b[i] == '\n') l[k++] = i + 1;
+    else if (b[i] == '\t') tabs[t++] = i;
+
+  ((void**) m)[0] = buf;
+  ((void**) m)[2] = lines;
+
+  __post_gc ();
+
+  return m;
+}
+
+/* The matcher m moved n characters forward; the caller has to call __pre_gc */
+static void* matcher_shift (void *m, int n) {
+  void *r;
+
+  push_extra_root (&m);
+  r = LmakeArray (BOX(3));
+  pop_extra_root (&m);
+
+  ((void**) r)[0] = ((void**) m)[0];
+  ((int*)   r)[1] = BOX(UNBOX(((int*) m)[1]) + n);
+  ((void**) r)[2] = ((void**) m)[2];
+
+  return r;
+}
+
+extern void* LmatcherString (void *m, void *s) {
+  char *buf;
+  int   pos, n;
+  void *r;
+
+  ASSERT_BOXED("matcherString:1", m);
+  ASSERT_STRING("matcherString:2", s);
+
+  buf = ((char**) m)[0];
+  pos = UNBOX(((int*) m)[1]);
+  n   = LEN(TO_DATA(s)->tag);
+
+  if (n > LEN(TO_DATA(buf)->tag) - pos || memcmp (buf + pos, s, n) != 0)
+    return (void*) BOX(0);
+
+  __pre_gc ();
+  r = matcher_shift (m, n);
+  __post_gc ();
+
+  return r;
+}
+
+extern void* LmatcherRegexp (void *m, struct re_pattern_buffer *b) {
+  int   n;
+  void *r;
+
+  ASSERT_BOXED("matcherRegexp:1", m);
+
+  n = UNBOX(LregexpMatch (b, ((char**) m)[0], ((int*) m)[1]));
+
+  if (n < 0) return (void*) BOX(0);
+
+  __pre_gc ();
+  r = matcher_shift (m, n);
+  __post_gc ();
+
+  return r;
+}
+
+/* The number of the elements of a sorted array a of n integers which are
+   not greater than x */
+static int count_not_greater (int *a, int n, int x) {
+  int lo = 0, hi = n;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (a[mid] <= x) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+/* The (zero-based) number of the line of the matcher m */
+static int matcher_line (void *m) {
+  int *l = ((int**) m)[2];
+
+  return count_not_greater (l + 1, l[0], UNBOX(((int*) m)[1])) - 1;
+}
+
+extern int LmatcherLine (void *m) {
+  ASSERT_BOXED("matcherLine:1", m);
+
+  return BOX(matcher_line (m) + 1);
+}
+
+/* Columns are counted from 1, a tab counts as 8 columns */
+extern int LmatcherCol (void *m) {
+  int *l, *tabs, pos, start, ntabs;
+
+  ASSERT_BOXED("matcherCol:1", m);
+
+  l     = ((int**) m)[2];
+  tabs  = l + 1 + l[0];
+  ntabs = LEN(TO_DATA(l)->tag) / sizeof (int) - 1 - l[0];
+  pos   = UNBOX(((int*) m)[1]);
+  start = l[1 + matcher_line (m)];
+
+  return BOX(pos - start + 1 +
+             7 * (count_not_greater (tabs, ntabs, pos - 1) - count_not_greater (tabs, ntabs, start - 1)));
+}
+
+extern void* Bstring (void*);
+
+void *Lclone (void *p) {
+  data *obj;
+  sexp *sobj;
+  void* res;
+  int n;
+#ifdef DEBUG_PRINT
+  register int * ebp asm ("ebp");
+  indent++; print_indent ();
+  printf ("Lclone arg: %p %p\n", &p, p); fflush (stdout);
+#endif
+  __pre_gc ();
+  
+  if (UNBOXED(p)) return p;
+  else {
+    data *a = TO_DATA(p);
+    int t   = TAG(a->tag), l = LEN(a->tag);
+
+    push_extra_root (&p);
+    switch (t) {
+    case STRING_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: string1 &p=%p p=%p\n", &p, p); fflush (stdout);
+#endif
+      res = LmakeString (BOX(l));
+      memcpy (res, TO_DATA(p)->contents, l);
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: string2 %p %p\n", &p, p); fflush (stdout);
+#endif
+      break;
+
+    case ARRAY_TAG:      
+    case CLOSURE_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
+#endif
+      obj = (data*) alloc (sizeof(int) * (l+1));
+      memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
+      res = (void*) (obj->contents);
+      ALLOC_PROF (res);
+      break;
+      
+    case SEXP_TAG:
+#ifdef DEBUG_PRINT
+      print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
+#endif
+      sobj = (sexp*) alloc (sizeof(int) * (l+2));
+      memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
+      res = (void*) sobj->contents.contents;
+      ALLOC_PROF (res);
+      break;
+       
+    default:
+      failure ("invalid tag %d in clone *****\n", t);
+    }
+    pop_extra_root (&p);
+  }
+#ifdef DEBUG_PRINT
+  print_indent (); printf ("Lclone ends1\n"); fflush (stdout);
+#endif
+
+  __post_gc ();
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("Lclone ends2\n"); fflush (stdout);
+  indent--;
+#endif
+  return res;
+}
+
+/* Structural hashing.
+
+   The hash covers the whole structure of a value: it is computed by an
+   explicit depth-first traversal which enters at most HASH_NODES boxed
+   values, thus the time is bounded and cyclic structures are handled.
+   Strings are hashed in full, a word at a time. Sexps are mutable, so
+   their hashes can not be cached. */
+
+# define HASH_NODES 256
+
+typedef struct {
+  void **fields;
+  int    i;
+  int    n;
+} hash_frame;
+
+static inline unsigned hash_rotl (unsigned x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline unsigned hash_mix (unsigned h, unsigned x) {
+  x *= 0xcc9e2d51u;
+  x  = hash_rotl (x, 15);
+  x *= 0x1b873593u;
+  h ^= x;
+  h  = hash_rotl (h, 13);
+  return h * 5 + 0xe6546b64u;
+}
+
+static inline unsigned hash_final (unsigned h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+static unsigned hash_bytes (unsigned h, char *s, int n) {
+  unsigned w;
+  int      i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    memcpy (&w, s + i, 4);
+    h = hash_mix (h, w);
+  }
+
+  for (w = 0; i < n; i++) w = (w << 8) | (unsigned char) s[i];
+
+  return hash_mix (h, w);
+}
+
+static unsigned inner_hash (void *p) {
+  hash_frame stack [HASH_NODES], *top = stack;
+  unsigned   h     = 0;
+  int        nodes = 0;
+
+  for (;;) {
+    if (UNBOXED(p)) h = hash_mix (h, UNBOX(p));
+    else if (! is_valid_heap_pointer (p)) h = hash_mix (h, (unsigned) p);
+    else if (nodes++ < HASH_NODES) {
+      data *a = TO_DATA(p);
+      int   t = TAG(a->tag), l = LEN(a->tag), i = 0;
+
+      h = hash_mix (h, t);
+      h = hash_mix (h, l);
+
+      switch (t) {
+      case STRING_TAG:
+        h = hash_bytes (h, a->contents, l);
+        l = 0;
+        break;
+
+      case CLOSURE_TAG:
+        h = hash_mix (h, ((unsigned*) a->contents)[0]);
+        i = 1;
+        break;
+
+      case ARRAY_TAG:
+        break;
+
+      case SEXP_TAG:
+#ifndef DEBUG_PRINT
+        h = hash_mix (h, TO_SEXP(p)->tag);
+#else
+        h = hash_mix (h, GET_SEXP_TAG(TO_SEXP(p)->tag));
+#endif
+        break;
+
+      default:
+        failure ("invalid tag %d in hash *****\n", t);
+      }
+
+      if (i < l) {
+        top->fields = (void**) a->contents;
+        top->i      = i;
+        top->n      = l;
+        top++;
+      }
+    }
+
+    while (top > stack && top[-1].i == top[-1].n) top--;
+
+    if (top == stack) return hash_final (h);
+
+    p = top[-1].fields [top[-1].i++];
+  }
+}
+
+extern void* LstringInt (char *b) {
+  int n;
+  sscanf (b, "%d", &n);
+  return (void*) BOX(n);
+}
+
+extern int Lhash (void *p) {
+  return BOX(0x3fffff & inner_hash (p));
+}
+
+extern int LflatCompare (void *p, void *q) {
+  if (UNBOXED(p)) {
+    if (UNBOXED(q)) {
+      return BOX (UNBOX(p) - UNBOX(q));
+    }
+    
+    return -1;
+  }
+  else if (~UNBOXED(q)) {
+    return BOX(p - q);
+  }
+  else BOX(1);
+}
+
+/* Structural comparison.
+
+   Values are compared by an explicit traversal: the stack holds the
+   containers whose fields are being compared. Physically equal values are
+   never traversed, and the last field of a container is compared in
+   place of the container itself, so comparing lists does not grow the
+   stack. The result of the first difference is returned as is. */
+
+# define COMPARE_STACK   64
+# define COMPARE_FIELDS  0  // not a boxed value: "compare the fields"
+
+typedef struct {
+  void **a;
+  void **b;
+  int    i;
+  int    n;
+} compare_frame;
+
+// Compares all but the fields of two values; for two containers of the same
+// shape returns COMPARE_FIELDS and sets *from, *a, *b and *n to the fields to
+// compare
+static int compare_head (void *p, void *q, int *from, void ***fa, void ***fb, int *n) {
 # define COMPARE_AND_RETURN(x,y) do if (x != y) return BOX(x - y); while (0)
   
   if (p == q) return BOX(0);
@@ -827,23 +1579,25 @@ extern int Lcompare (void *p, void *q) {
         data *a = TO_DATA(p), *b = TO_DATA(q);
         int ta = TAG(a->tag), tb = TAG(b->tag);
         int la = LEN(a->tag), lb = LEN(b->tag);
-        int i;
+        int c;
     
         COMPARE_AND_RETURN (ta, tb);
       
         switch (ta) {
         case STRING_TAG:
-          return BOX(strcmp (a->contents, b->contents));
+          c = memcmp (a->contents, b->contents, la < lb ? la : lb);
+          if (c == 0) c = la - lb;
+          return BOX(c < 0 ? -1 : c > 0);
       
         case CLOSURE_TAG:
-          COMPARE_AND_RETURN (((void**) a->contents)[0], ((void**) b->contents)[0]);
+          COMPARE_AND_RETURN (((int*) a->contents)[0], ((int*) b->contents)[0]);
           COMPARE_AND_RETURN (la, lb);
-          i = 1;
+          *from = 1;
           break;
       
         case ARRAY_TAG:
           COMPARE_AND_RETURN (la, lb);
-          i = 0;
+          *from = 0;
           break;
 
         case SEXP_TAG: {
@@ -854,7 +1608,7 @@ extern int Lcompare (void *p, void *q) {
 #endif      
           COMPARE_AND_RETURN (ta, tb);
           COMPARE_AND_RETURN (la, lb);
-          i = 0;
+          *from = 0;
           break;
         }
 
@@ -862,467 +1616,1868 @@ extern int Lcompare (void *p, void *q) {
           failure ("invalid tag %d in compare *****\n", ta);
         }
 
-        for (; i<la; i++) {
-          int c = Lcompare (((void**) a->contents)[i], ((void**) b->contents)[i]);
-          if (c != BOX(0)) return BOX(c);
-        }
-    
-        return BOX(0);
+        *fa = (void**) a->contents;
+        *fb = (void**) b->contents;
+        *n  = la;
+        
+        return COMPARE_FIELDS;
       }
       else return BOX(-1);
     }
-    else if (is_valid_heap_pointer (q)) return BOX(1);
-    else return BOX (p - q);
+    else if (is_valid_heap_pointer (q)) return BOX(1);
+    else return BOX ((int) p - (int) q);
+  }
+# undef COMPARE_AND_RETURN
+}
+
+extern int Lcompare (void *p, void *q) {
+  compare_frame  local [COMPARE_STACK],
+                *stack = local,
+                *top   = local;
+  int            size  = COMPARE_STACK, i, n, c;
+  void         **a, **b;
+
+  for (;;) {
+    c = compare_head (p, q, &i, &a, &b, &n);
+
+    if (c == COMPARE_FIELDS) {
+      if (i == n) c = BOX(0);
+      else {
+        if (i < n - 1) {
+          if (top == stack + size) {
+            compare_frame *s = (compare_frame*) malloc (2 * size * sizeof (compare_frame));
+
+            if (s == NULL) failure ("compare: out of memory\n");
+
+            memcpy (s, stack, size * sizeof (compare_frame));
+            if (stack != local) free (stack);
+
+            top   = s + size;
+            stack = s;
+            size *= 2;
+          }
+
+          top->a = a;
+          top->b = b;
+          top->i = i + 1;
+          top->n = n;
+          top++;
+        }
+
+        p = a[i];
+        q = b[i];
+        continue;
+      }
+    }
+
+    if (c == BOX(0) && top > stack) {
+      compare_frame *f = top - 1;
+
+      p = f->a[f->i];
+      q = f->b[f->i];
+
+      if (++f->i == f->n) top--;
+
+      continue;
+    }
+
+    if (stack != local) free (stack);
+
+    return c;
+  }
+}
+
+/* Sorting.
+
+   Arrays are sorted in place by introsort (quicksort with a median-of-three
+   pivot, falling back to heapsort on deep recursion and to insertion sort on
+   short ranges). When the comparison is the generic "compare" the elements
+   are compared natively (with dedicated paths for arrays of integers and of
+   strings); otherwise the comparison closure is called back through
+   __call_closure2. A call back may trigger the GC, which moves the array and
+   its elements; thus no derived pointers are kept, and all the values which
+   live across comparisons reside in volatile stack locations, where the
+   conservative stack scan finds and updates them. */
+
+# define SORT_THRESHOLD 16
+
+extern int __call_closure2 (void *closure, void *x, void *y);
+
+typedef struct {
+  void ** volatile a;                     /* the array being sorted      */
+  void  * volatile f;                     /* the comparison closure      */
+  int (*cmp) (void * volatile *f, void *x, void *y);
+} sort_state;
+
+static int sort_cmp_int (void * volatile *f, void *x, void *y) {
+  return (int) x < (int) y ? -1 : (int) x > (int) y;
+}
+
+static int sort_cmp_string (void * volatile *f, void *x, void *y) {
+  data *a = TO_DATA(x), *b = TO_DATA(y);
+  int   la = LEN(a->tag), lb = LEN(b->tag);
+  int   c  = memcmp (a->contents, b->contents, la < lb ? la : lb);
+
+  return c == 0 ? la - lb : c;
+}
+
+static int sort_cmp_generic (void * volatile *f, void *x, void *y) {
+  return UNBOX(Lcompare (x, y));
+}
+
+static int sort_cmp_closure (void * volatile *f, void *x, void *y) {
+  int c = __call_closure2 (*f, x, y);
+
+  ASSERT_UNBOXED("sortArray: comparison result", c);
+
+  return UNBOX(c);
+}
+
+static inline int sort_less (sort_state *s, void *x, void *y) {
+  return s->cmp (&s->f, x, y) < 0;
+}
+
+static inline void sort_swap (sort_state *s, int i, int j) {
+  void *t = s->a[i];
+
+  s->a[i] = s->a[j];
+  s->a[j] = t;
+}
+
+static void sort_insertion (sort_state *s, int lo, int hi) {
+  int i, j;
+
+  for (i = lo + 1; i < hi; i++) {
+    void * volatile x = s->a[i];
+
+    for (j = i; j > lo && sort_less (s, x, s->a[j-1]); j--) s->a[j] = s->a[j-1];
+
+    s->a[j] = x;
+  }
+}
+
+static void sort_sift (sort_state *s, int lo, int i, int n) {
+  void * volatile x = s->a[lo + i];
+  int             c;
+
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && sort_less (s, s->a[lo + c], s->a[lo + c + 1])) c++;
+    if (! sort_less (s, x, s->a[lo + c])) break;
+
+    s->a[lo + i] = s->a[lo + c];
+    i = c;
+  }
+
+  s->a[lo + i] = x;
+}
+
+static void sort_heap (sort_state *s, int lo, int hi) {
+  int n = hi - lo, i;
+
+  for (i = n / 2 - 1; i >= 0; i--) sort_sift (s, lo, i, n);
+
+  for (i = n - 1; i > 0; i--) {
+    sort_swap (s, lo, lo + i);
+    sort_sift (s, lo, 0, i);
+  }
+}
+
+/* Partitions [lo, hi) around the median of its first, middle and last
+   elements; returns j such that [lo, j] and [j+1, hi) are to be sorted */
+static int sort_partition (sort_state *s, int lo, int hi) {
+  int             mid = lo + (hi - lo - 1) / 2, i = lo - 1, j = hi;
+  void * volatile pivot;
+
+  if (sort_less (s, s->a[mid], s->a[lo])) sort_swap (s, mid, lo);
+  if (sort_less (s, s->a[hi-1], s->a[mid])) {
+    sort_swap (s, hi-1, mid);
+    if (sort_less (s, s->a[mid], s->a[lo])) sort_swap (s, mid, lo);
+  }
+
+  pivot = s->a[mid];
+
+  // the scans are bounded: an inconsistent comparator may defeat the sentinels
+  for (;;) {
+    do i++; while (i < hi - 1 && sort_less (s, s->a[i], pivot));
+    do j--; while (j > lo && sort_less (s, pivot, s->a[j]));
+
+    if (i >= j) return j;
+
+    sort_swap (s, i, j);
+  }
+}
+
+static void sort_range (sort_state *s, int lo, int hi, int depth) {
+  while (hi - lo > SORT_THRESHOLD) {
+    int p;
+
+    if (depth-- == 0) {
+      sort_heap (s, lo, hi);
+      return;
+    }
+
+    p = sort_partition (s, lo, hi);
+
+    if (p + 1 - lo < hi - p - 1) {
+      sort_range (s, lo, p + 1, depth);
+      lo = p + 1;
+    }
+    else {
+      sort_range (s, p + 1, hi, depth);
+      hi = p + 1;
+    }
+  }
+
+  sort_insertion (s, lo, hi);
+}
+
+extern void* LsortArray (void *a, void *f) {
+  sort_state s;
+  int        n, i, depth = 0, ints = 1, strings = 1;
+
+  ASSERT_BOXED("sortArray:1", a);
+  ASSERT_BOXED("sortArray:2", f);
+
+  if (TAG(TO_DATA(a)->tag) != ARRAY_TAG) failure ("sortArray: array expected\n");
+  if (TAG(TO_DATA(f)->tag) != CLOSURE_TAG) failure ("sortArray: closure expected\n");
+
+  n   = LEN(TO_DATA(a)->tag);
+  s.a = (void**) a;
+  s.f = f;
+
+  if (((void**) f)[0] == (void*) Lcompare) {
+    for (i = 0; i < n && (ints || strings); i++) {
+      void *x = s.a[i];
+
+      if (UNBOXED(x)) strings = 0;
+      else {
+        ints = 0;
+        if (! is_valid_heap_pointer (x) || TAG(TO_DATA(x)->tag) != STRING_TAG) strings = 0;
+      }
+    }
+
+    s.cmp = ints ? sort_cmp_int : strings ? sort_cmp_string : sort_cmp_generic;
+  }
+  else s.cmp = sort_cmp_closure;
+
+  for (i = n; i > 1; i >>= 1) depth += 2;
+
+  sort_range (&s, 0, n, depth);
+
+  return s.a;
+}
+
+extern void* Belem (void *p, int i) {
+  data *a = (data *)BOX(NULL);
+
+  ASSERT_BOXED(".elem:1", p);
+  ASSERT_UNBOXED(".elem:2", i);
+  
+  a = TO_DATA(p);
+  i = UNBOX(i);
+  
+  if (TAG(a->tag) == STRING_TAG) {
+    return (void*) BOX(a->contents[i]);
+  }
+  
+  return (void*) ((int*) a->contents)[i];
+}
+
+extern void* LmakeArray (int length) {
+  data *r;
+  int n, *p;
+
+  ASSERT_UNBOXED("makeArray:1", length);
+  
+  __pre_gc ();
+
+  n = UNBOX(length);
+  r = (data*) alloc (sizeof(int) * (n+1));
+
+  r->tag = ARRAY_TAG | (n << 3);
+
+  p = (int*) r->contents;
+  while (n--) *p++ = BOX(0);
+
+  ALLOC_PROF (r->contents);
+
+  __post_gc ();
+
+  return r->contents;
+}
+
+/* Bulk array operations */
+
+static void array_range (char *name, void *a, int pos, int len) {
+  int n;
+
+  if (TAG(TO_DATA(a)->tag) != ARRAY_TAG) failure ("%s: array expected\n", name);
+
+  n = LEN(TO_DATA(a)->tag);
+
+  if (pos < 0 || len < 0 || pos > n - len)
+    failure ("%s: range %d..%d out of bounds (length %d)\n", name, pos, pos + len, n);
+}
+
+extern void* LarrayBlit (void *src, int sp, void *dst, int dp, int len) {
+  ASSERT_BOXED("arrayBlit:1", src);
+  ASSERT_UNBOXED("arrayBlit:2", sp);
+  ASSERT_BOXED("arrayBlit:3", dst);
+  ASSERT_UNBOXED("arrayBlit:4", dp);
+  ASSERT_UNBOXED("arrayBlit:5", len);
+
+  array_range ("arrayBlit", src, UNBOX(sp), UNBOX(len));
+  array_range ("arrayBlit", dst, UNBOX(dp), UNBOX(len));
+
+  memmove ((int*) dst + UNBOX(dp), (int*) src + UNBOX(sp), UNBOX(len) * sizeof (int));
+
+  return dst;
+}
+
+extern void* LarrayFill (void *a, int pos, int len, void *x) {
+  int *p, n;
+
+  ASSERT_BOXED("arrayFill:1", a);
+  ASSERT_UNBOXED("arrayFill:2", pos);
+  ASSERT_UNBOXED("arrayFill:3", len);
+
+  array_range ("arrayFill", a, UNBOX(pos), UNBOX(len));
+
+  for (p = (int*) a + UNBOX(pos), n = UNBOX(len); n--; ) *p++ = (int) x;
+
+  return a;
+}
+
+extern void* LarraySub (void *a, int pos, int len) {
+  void *r;
+
+  ASSERT_BOXED("arraySub:1", a);
+  ASSERT_UNBOXED("arraySub:2", pos);
+  ASSERT_UNBOXED("arraySub:3", len);
+
+  array_range ("arraySub", a, UNBOX(pos), UNBOX(len));
+
+  __pre_gc ();
+
+  push_extra_root (&a);
+  r = LmakeArray (len);
+  pop_extra_root (&a);
+
+  memcpy (r, (int*) a + UNBOX(pos), UNBOX(len) * sizeof (int));
+
+  __post_gc ();
+
+  return r;
+}
+
+extern void* LarrayAppend (void *a, void *b) {
+  void *r;
+  int   la, lb;
+
+  ASSERT_BOXED("arrayAppend:1", a);
+  ASSERT_BOXED("arrayAppend:2", b);
+
+  array_range ("arrayAppend", a, 0, 0);
+  array_range ("arrayAppend", b, 0, 0);
+
+  la = LEN(TO_DATA(a)->tag);
+  lb = LEN(TO_DATA(b)->tag);
+
+  __pre_gc ();
+
+  push_extra_root (&a);
+  push_extra_root (&b);
+  r = LmakeArray (BOX(la + lb));
+  pop_extra_root (&b);
+  pop_extra_root (&a);
+
+  memcpy (r, a, la * sizeof (int));
+  memcpy ((int*) r + la, b, lb * sizeof (int));
+
+  __post_gc ();
+
+  return r;
+}
+
+/* Native initArray/mapArray call the closure back for each element. They
+   are deliberately not enclosed in __pre_gc/__post_gc: a collection,
+   triggered by the closure, has to scan the whole stack including the frames
+   of the closure and this one; the values which live across the calls are
+   kept in volatile locals to be found and updated by the scan. */
+
+extern int __call_closure1 (void *closure, void *x);
+
+static void check_closure (char *name, void *f) {
+  if (UNBOXED(f) || TAG(TO_DATA(f)->tag) != CLOSURE_TAG) failure ("%s: closure expected\n", name);
+}
+
+extern void* LarrayInit (int n, void *f) {
+  void * volatile fv = f, * volatile r;
+  int             i;
+
+  ASSERT_UNBOXED("arrayInit:1", n);
+  check_closure ("arrayInit", f);
+
+  r = LmakeArray (n);
+
+  for (i = 0; i < UNBOX(n); i++) {
+    int x = __call_closure1 (fv, (void*) BOX(i));
+
+    ((int*) r)[i] = x;
+  }
+
+  return r;
+}
+
+extern void* LarrayMap (void *f, void *a) {
+  void * volatile fv = f, * volatile av = a, * volatile r;
+  int             i, n;
+
+  ASSERT_BOXED("arrayMap:2", a);
+  check_closure ("arrayMap", f);
+  array_range ("arrayMap", a, 0, 0);
+
+  n = LEN(TO_DATA(a)->tag);
+  r = LmakeArray (BOX(n));
+
+  for (i = 0; i < n; i++) {
+    int x = __call_closure1 (fv, ((void**) av)[i]);
+
+    ((int*) r)[i] = x;
+  }
+
+  return r;
+}
+
+extern void* LmakeString (int length) {
+  int   n = UNBOX(length);
+  data *r;
+
+  ASSERT_UNBOXED("makeString", length);
+  
+  __pre_gc () ;
+  
+  r = (data*) alloc (n + 1 + sizeof (int));
+
+  r->tag = STRING_TAG | (n << 3);
+  r->contents[n] = 0;
+
+  ALLOC_PROF (r->contents);
+
+  __post_gc();
+  
+  return r->contents;
+}
+
+extern void* Bstring (void *p) {
+  int   n = strlen (p);
+  data *s = NULL;
+  
+  __pre_gc ();
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("Bstring: call LmakeString %s %p %p %p %i\n", p, &p, p, s, n);
+  fflush(stdout);
+#endif
+  push_extra_root (&p);
+  s = LmakeString (BOX(n));  
+  pop_extra_root(&p);
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("\tBstring: call strncpy: %p %p %p %i\n", &p, p, s, n); fflush(stdout);
+#endif
+  strncpy ((char*)s, p, n + 1);
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("\tBstring: ends\n"); fflush(stdout);
+  indent--;
+#endif
+  __post_gc ();
+  
+  return s;
+}
+
+extern void* Lstringcat (void *p) {
+  void *s;
+  int   n;
+
+  /* ASSERT_BOXED("stringcat", p); */
+  
+  __pre_gc ();
+
+  n = stringcat_length (p);
+
+  if (n >= 0) {
+    // the common case: the result is allocated once with its exact length
+    // and filled in directly, in time linear in the size of the result
+    push_extra_root(&p);
+    s = LmakeString (BOX(n));
+    pop_extra_root(&p);
+
+    *stringcat_copy ((char*) s, p) = 0;
+  }
+  else {
+    createStringBuf ();
+    stringcat (p);
+
+    s = stringBufString ();
+  
+    deleteStringBuf ();
+  }
+
+  __post_gc ();
+
+  return s;  
+}
+
+extern void* Lstring (void *p) {
+  void *s = (void *) BOX (NULL);
+
+  __pre_gc () ;
+  
+  createStringBuf ();
+  printValue (p);
+
+  s = stringBufString ();
+  
+  deleteStringBuf ();
+
+  __post_gc ();
+
+  return s;
+}
+
+extern void* Bclosure (int bn, void *entry, ...) {
+  va_list args; 
+  int     i, ai;
+  register int * ebp asm ("ebp");
+  size_t  *argss;
+  data    *r; 
+  int     n = UNBOX(bn);
+  
+  __pre_gc ();
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("Bclosure: create n = %d\n", n); fflush(stdout);
+#endif
+  argss = (ebp + 12);
+  for (i = 0; i<n; i++, argss++) {
+    push_extra_root ((void**)argss);
+  }
+
+  r = (data*) alloc (sizeof(int) * (n+2));
+  
+  r->tag = CLOSURE_TAG | ((n + 1) << 3);
+  ((void**) r->contents)[0] = entry;
+  
+  va_start(args, entry);
+  
+  for (i = 0; i<n; i++) {
+    ai = va_arg(args, int);
+    ((int*)r->contents)[i+1] = ai;
+  }
+  
+  va_end(args);
+
+  ALLOC_PROF (r->contents);
+
+  __post_gc();
+
+  argss--;
+  for (i = 0; i<n; i++, argss--) {
+    pop_extra_root ((void**)argss);
+  }
+
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("Bclosure: ends\n", n); fflush(stdout);
+  indent--;
+#endif
+
+  return r->contents;
+}
+
+extern void* Barray (int bn, ...) {
+  va_list args; 
+  int     i, ai; 
+  data    *r; 
+  int     n = UNBOX(bn);
+    
+  __pre_gc ();
+  
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("Barray: create n = %d\n", n); fflush(stdout);
+#endif
+  r = (data*) alloc (sizeof(int) * (n+1));
+
+  r->tag = ARRAY_TAG | (n << 3);
+  
+  va_start(args, bn);
+  
+  for (i = 0; i<n; i++) {
+    ai = va_arg(args, int);
+    ((int*)r->contents)[i] = ai;
+  }
+  
+  va_end(args);
+
+  ALLOC_PROF (r->contents);
+
+  __post_gc();
+#ifdef DEBUG_PRINT
+  indent--;
+#endif
+  return r->contents;
+}
+
+extern void* Bsexp (int bn, ...) {
+  va_list args; 
+  int     i;    
+  int     ai;  
+  size_t *p;  
+  sexp   *r;  
+  data   *d;  
+  int n = UNBOX(bn); 
+
+  __pre_gc () ;
+  
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf("Bsexp: allocate %zu!\n",sizeof(int) * (n+1)); fflush (stdout);
+#endif
+  r = (sexp*) alloc (sizeof(int) * (n+1));
+  d = &(r->contents);
+  r->tag = 0;
+    
+  d->tag = SEXP_TAG | ((n-1) << 3);
+  
+  va_start(args, bn);
+  
+  for (i=0; i<n-1; i++) {
+    ai = va_arg(args, int);
+    
+    p = (size_t*) ai;
+    ((int*)d->contents)[i] = ai;
+  }
+
+  r->tag = UNBOX(va_arg(args, int));
+
+#ifdef DEBUG_PRINT
+  r->tag = SEXP_TAG | ((r->tag) << 3);
+  print_indent ();
+  printf("Bsexp: ends\n"); fflush (stdout);
+  indent--;
+#endif
+
+  va_end(args);
+
+  ALLOC_PROF (d->contents);
+
+  __post_gc();
+
+  return d->contents;
+}
+
+/* Allocates a cons cell for the values at x and xs; the caller has to
+   register both locations as extra roots since the allocation may move them */
+static void* make_cons (void **x, void **xs) {
+  static int cons_tag = 0;
+  sexp *r;
+  data *d;
+
+  if (! cons_tag) cons_tag = UNBOX(LtagHash ("cons"));
+
+  r = (sexp*) alloc (sizeof(int) * 4);
+  d = &(r->contents);
+
+  d->tag = SEXP_TAG | (2 << 3);
+#ifndef DEBUG_PRINT
+  r->tag = cons_tag;
+#else
+  r->tag = SEXP_TAG | (cons_tag << 3);
+#endif
+  ((void**) d->contents)[0] = *x;
+  ((void**) d->contents)[1] = *xs;
+
+  ALLOC_PROF (d->contents);
+
+  return d->contents;
+}
+
+/* Mutable hash tables.
+
+   A table is an ordinary array [n, slots], where n is the number of occupied
+   slots and slots is an array of power-of-two length addressed by linear
+   probing. A slot is either 0 (free) or an array [h, x] binding an integer
+   hash h to an arbitrary value x. The table never gets more than half full.
+   Slots bound to {} keep their place (and are reused for the same hash) until
+   the next resize drops them. */
+
+# define HASHTAB_MIN 8
+
+static int hashtab_lookup (void **slots, int h) {
+  int mask = LEN(TO_DATA(slots)->tag) - 1;
+  int i    = hash_final ((unsigned) UNBOX(h)) & mask;
+
+  while (! UNBOXED(slots[i]) && ((int*) slots[i])[0] != h) i = (i + 1) & mask;
+
+  return i;
+}
+
+static inline int hashtab_live (void *e) {
+  return ! UNBOXED(e) && ((int*) e)[1] != BOX(0);
+}
+
+/* Rehashes the live slots of the table at *t into a fresh array with room
+   for at least one more binding; *t has to be an extra root */
+static void hashtab_resize (void **t) {
+  void **old   = ((void***) *t)[1], **slots;
+  int    n     = LEN(TO_DATA(old)->tag), live = 0, cap = HASHTAB_MIN, i;
+
+  for (i = 0; i < n; i++) live += hashtab_live (old[i]);
+
+  while (cap < 4 * (live + 1)) cap <<= 1;
+
+  slots = LmakeArray (BOX(cap));
+  old   = ((void***) *t)[1];
+
+  for (i = 0; i < n; i++)
+    if (hashtab_live (old[i]))
+      slots[hashtab_lookup (slots, ((int*) old[i])[0])] = old[i];
+
+  ((void***) *t)[1] = slots;
+  ((int*) *t)[0]    = BOX(live);
+}
+
+extern void* LmakeHashTab (int n) {
+  void *slots, *t;
+  int   cap = HASHTAB_MIN;
+
+  ASSERT_UNBOXED("makeHashTab:1", n);
+
+  while (cap < UNBOX(n)) cap <<= 1;
+
+  __pre_gc ();
+
+  slots = LmakeArray (BOX(cap));
+  push_extra_root (&slots);
+  t = LmakeArray (BOX(2));
+  pop_extra_root (&slots);
+
+  ((void**) t)[1] = slots;
+
+  __post_gc ();
+
+  return t;
+}
+
+extern void* LhashTabGet (void *t, int h) {
+  void **slots;
+  int    i;
+
+  ASSERT_BOXED("hashTabGet:1", t);
+  ASSERT_UNBOXED("hashTabGet:2", h);
+
+  slots = ((void***) t)[1];
+  i     = hashtab_lookup (slots, h);
+
+  return UNBOXED(slots[i]) ? (void*) BOX(0) : ((void**) slots[i])[1];
+}
+
+extern void* LhashTabPut (void *t, int h, void *x) {
+  void **slots, *e;
+  int    i;
+
+  ASSERT_BOXED("hashTabPut:1", t);
+  ASSERT_UNBOXED("hashTabPut:2", h);
+
+  slots = ((void***) t)[1];
+  i     = hashtab_lookup (slots, h);
+
+  if (! UNBOXED(slots[i])) {
+    ((void**) slots[i])[1] = x;
+    return t;
+  }
+
+  __pre_gc ();
+
+  push_extra_root (&t);
+  push_extra_root (&x);
+
+  if (2 * (UNBOX(((int*) t)[0]) + 1) > LEN(TO_DATA(slots)->tag)) {
+    hashtab_resize (&t);
+    i = hashtab_lookup (((void***) t)[1], h);
+  }
+
+  e = LmakeArray (BOX(2));
+  ((int*)   e)[0] = h;
+  ((void**) e)[1] = x;
+
+  ((void***) t)[1][i] = e;
+  ((int*) t)[0] = BOX(UNBOX(((int*) t)[0]) + 1);
+
+  pop_extra_root (&x);
+  pop_extra_root (&t);
+
+  __post_gc ();
+
+  return t;
+}
+
+extern void* LhashTabChains (void *t) {
+  void *acc = (void*) BOX(0), *x = (void*) BOX(0);
+  int   i;
+
+  ASSERT_BOXED("hashTabChains:1", t);
+
+  __pre_gc ();
+
+  push_extra_root (&t);
+  push_extra_root (&acc);
+  push_extra_root (&x);
+
+  for (i = LEN(TO_DATA(((void**) t)[1])->tag) - 1; i >= 0; i--) {
+    void *e = ((void***) t)[1][i];
+
+    if (hashtab_live (e)) {
+      x   = ((void**) e)[1];
+      acc = make_cons (&x, &acc);
+    }
+  }
+
+  pop_extra_root (&x);
+  pop_extra_root (&acc);
+  pop_extra_root (&t);
+
+  __post_gc ();
+
+  return acc;
+}
+
+extern int Btag (void *d, int t, int n) {
+  data *r; 
+  
+  if (UNBOXED(d)) return BOX(0);
+  else {
+    r = TO_DATA(d);
+#ifndef DEBUG_PRINT
+    return BOX(TAG(r->tag) == SEXP_TAG && TO_SEXP(d)->tag == UNBOX(t) && LEN(r->tag) == UNBOX(n));
+#else
+    return BOX(TAG(r->tag) == SEXP_TAG &&
+               GET_SEXP_TAG(TO_SEXP(d)->tag) == UNBOX(t) && LEN(r->tag) == UNBOX(n));
+#endif
+  }
+}
+
+extern int Barray_patt (void *d, int n) {
+  data *r; 
+  
+  if (UNBOXED(d)) return BOX(0);
+  else {
+    r = TO_DATA(d);
+    return BOX(TAG(r->tag) == ARRAY_TAG && LEN(r->tag) == UNBOX(n));
+  }
+}
+
+extern int Bstring_patt (void *x, void *y) {
+  data *rx = (data *) BOX (NULL),
+       *ry = (data *) BOX (NULL);
+  
+  ASSERT_STRING(".string_patt:2", y);
+      
+  if (UNBOXED(x)) return BOX(0);
+  else {
+    rx = TO_DATA(x); ry = TO_DATA(y);
+
+    if (TAG(rx->tag) != STRING_TAG) return BOX(0);
+    
+    return BOX(strcmp (rx->contents, ry->contents) == 0 ? 1 : 0);
+  }
+}
+
+extern int Bclosure_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == CLOSURE_TAG);
+}
+
+extern int Bboxed_patt (void *x) {
+  return BOX(UNBOXED(x) ? 0 : 1);
+}
+
+extern int Bunboxed_patt (void *x) {
+  return BOX(UNBOXED(x) ? 1 : 0);
+}
+
+extern int Barray_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == ARRAY_TAG);
+}
+
+extern int Bstring_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == STRING_TAG);
+}
+
+extern int Bsexp_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == SEXP_TAG);
+}
+
+extern void* Bsta (void *v, int i, void *x) {
+  if (UNBOXED(i)) {
+    ASSERT_BOXED(".sta:3", x);
+    //    ASSERT_UNBOXED(".sta:2", i);
+  
+    if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
+    else ((int*) x)[UNBOX(i)] = (int) v;
+
+    return v;
+  }
+
+  * (void**) x = v;
+
+  return v;
+}
+
+static void fix_unboxed (char *s, va_list va) {
+  size_t *p = (size_t*)va;
+  int i = 0;
+  
+  while (*s) {
+    if (*s == '%' && s[1] == '%') s++;
+    else if (*s == '%') {
+      size_t n = p [i];
+      if (UNBOXED (n)) {
+	p[i] = UNBOX(n);
+      }
+      i++;
+    }
+    s++;
+  } 
+}
+
+extern void Lfailure (char *s, ...) {
+  va_list args;
+  
+  va_start    (args, s);
+  fix_unboxed (s, args);
+  vfailure    (s, args);
+}
+
+extern void Bmatch_failure (void *v, char *fname, int line, int col) {
+  createStringBuf ();
+  printValue (v);
+  failure ("match failure at %s:%d:%d, value '%s'\n",
+	   fname, UNBOX(line), UNBOX(col), stringBuf.contents);
+}
+
+extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
+  data *da = (data*) BOX (NULL);
+  data *db = (data*) BOX (NULL);
+  data *d  = (data*) BOX (NULL);
+
+  ASSERT_STRING("++:1", a);
+  ASSERT_STRING("++:2", b);
+  
+  da = TO_DATA(a);
+  db = TO_DATA(b);
+
+  __pre_gc () ;
+
+  push_extra_root (&a);
+  push_extra_root (&b);
+  d  = (data *) alloc (sizeof(int) + LEN(da->tag) + LEN(db->tag) + 1);
+  pop_extra_root (&b);
+  pop_extra_root (&a);
+
+  da = TO_DATA(a);
+  db = TO_DATA(b);
+  
+  d->tag = STRING_TAG | ((LEN(da->tag) + LEN(db->tag)) << 3);
+
+  memcpy (d->contents               , da->contents, LEN(da->tag));
+  memcpy (d->contents + LEN(da->tag), db->contents, LEN(db->tag));
+  
+  d->contents[LEN(da->tag) + LEN(db->tag)] = 0;
+
+  ALLOC_PROF (d->contents);
+
+  __post_gc();
+  
+  return d->contents;
+}
+
+extern void* Lsprintf (char * fmt, ...) {
+  va_list args;
+  void *s;
+
+  ASSERT_STRING("sprintf:1", fmt);
+  
+  va_start (args, fmt);
+  fix_unboxed (fmt, args);
+  
+  createStringBuf ();
+
+  vprintStringBuf (fmt, args);
+  va_end (args);
+
+  s = stringBufString ();
+  
+  deleteStringBuf ();
+
+  return s;
+}
+
+extern void* LgetEnv (char *var) {
+  char *e = getenv (var);
+  void *s;
+  
+  if (e == NULL)
+    return BOX(0);
+
+  __pre_gc ();
+
+  s = Bstring (e);
+
+  __post_gc ();
+
+  return s;
+}
+
+extern int Lsystem (char *cmd) {
+  return BOX (system (cmd));
+}
+
+/* Parallel tasks.
+
+   A task runs in a thread of its own with a separate heap: the heap, the
+   extra roots, the stack bounds of the collector and the formatting buffer
+   are thread-local, so the threads allocate and collect garbage
+   independently, without locking. The function of a task and its result are
+   passed between the heaps by copying (see messages below). The global
+   variables of the program are shared by all threads and scanned by all
+   collectors, but each collector only moves the objects of its own heap;
+   thus the tasks must not store boxed values into global variables nor rely
+   on the boxed values, stored there by other threads. A value of the heap of
+   a task found in a global variable (at each collection in the task and when
+   the task finishes) fails the program.
+
+   Messages.
+
+   A value is flattened into a message (outside of the heaps), from which a
+   copy is rebuilt in the heap of the receiver, like "clone" does, but
+   deeply. The objects reachable from the value are numbered in the order of
+   discovery (the value itself gets 0) and each of them is copied once, so
+   shared substructures stay shared and cyclic values are supported. Entries
+   of closures and pointers out of the heap (e.g. memory-mapped strings) are
+   copied as they are, since they are valid in all threads.
+
+   A message is the number n of objects, followed either by the value itself
+   (if n is 0, i.e. the value is not an object of the heap), or by the
+   descriptions of the objects in the order of numbering:
+
+     MSG_STRING n c_1...   --- a string of n characters, padded to words
+     MSG_ARRAY n f_1...    --- an array of n fields
+     MSG_SEXP n t f_1...   --- an S-expression with the tag t and n fields
+     MSG_CLOSURE n f_1...  --- a closure of n fields (the first is its entry)
+
+   where a field is either "MSG_VALUE x" (an unboxed value or a pointer out of
+   the heap), or "MSG_OBJECT i" (the object number i). */
+
+# define MSG_STRING  0
+# define MSG_ARRAY   1
+# define MSG_SEXP    2
+# define MSG_CLOSURE 3
+# define MSG_VALUE   4
+# define MSG_OBJECT  5
+
+# define MSG_WORDS(n) (((n) + sizeof (int) - 1) / sizeof (int))
+
+typedef struct {
+  int *words;
+  int  size;
+  int  len;
+} msg_buf;
+
+static void msg_put (msg_buf *b, int w) {
+  if (b->len == b->size) {
+    int *words = (int*) realloc (b->words, (b->size ? 2 * b->size : 1024) * sizeof (int));
+
+    if (words == NULL) failure ("spawn/join: out of memory\n");
+
+    b->words = words;
+    b->size  = b->size ? 2 * b->size : 1024;
+  }
+
+  b->words[b->len++] = w;
+}
+
+static int msg_in_heap (void *p) {
+  return !UNBOXED(p) &&
+         (size_t) from_space.begin <= (size_t) p && (size_t) p < (size_t) from_space.end;
+}
+
+/* The objects of a value being flattened: the objects in the order of
+   numbering, and a hash table (with open addressing) of their numbers + 1 */
+typedef struct {
+  void **objs;
+  int   *index;
+  int    n;
+  int    size;  /* of the table, a power of two; objs holds size/2 objects */
+} msg_objects;
+
+static int msg_slot (msg_objects *t, void *p) {
+  int i = ((size_t) p >> 2) * 2654435761u & (t->size - 1);
+
+  while (t->index[i] && t->objs[t->index[i]-1] != p) i = (i + 1) & (t->size - 1);
+
+  return i;
+}
+
+/* The number of the object p; numbers p if it is met for the first time */
+static int msg_number (msg_objects *t, void *p) {
+  int i;
+
+  if (2 * (t->n + 1) > t->size) {
+    int    size  = t->size ? 2 * t->size : 1024;
+    int   *index = (int*)   calloc (size, sizeof (int));
+    void **objs  = (void**) realloc (t->objs, size / 2 * sizeof (void*));
+
+    if (index == NULL || objs == NULL) failure ("spawn/join: out of memory\n");
+
+    free (t->index);
+    t->index = index;
+    t->objs  = objs;
+    t->size  = size;
+
+    for (i = 0; i < t->n; i++) t->index[msg_slot (t, t->objs[i])] = i + 1;
+  }
+
+  i = msg_slot (t, p);
+
+  if (t->index[i] == 0) {
+    t->objs[t->n++] = p;
+    t->index[i]     = t->n;
+  }
+
+  return t->index[i] - 1;
+}
+
+/* Flattens a value of the heap of the current thread into an empty message */
+static void msg_encode (msg_buf *b, void *v) {
+  msg_objects t = {NULL, NULL, 0, 0};
+  int         i, j, n;
+
+  msg_put (b, 0);
+
+  if (! msg_in_heap (v)) {
+    msg_put (b, (int) v);
+    return;
+  }
+
+  msg_number (&t, v);
+
+  for (i = 0; i < t.n; i++) {
+    void *p = t.objs[i];
+    data *d = TO_DATA(p);
+
+    n = LEN(d->tag);
+
+    switch (TAG(d->tag)) {
+    case STRING_TAG:
+      msg_put (b, MSG_STRING);
+      msg_put (b, n);
+
+      for (j = 0; j < n; j += sizeof (int)) {
+        int w = 0;
+
+        memcpy (&w, (char*) p + j, n - j < sizeof (int) ? n - j : sizeof (int));
+        msg_put (b, w);
+      }
+
+      continue;
+
+    case ARRAY_TAG:
+      msg_put (b, MSG_ARRAY);
+      msg_put (b, n);
+      break;
+
+    case SEXP_TAG:
+      msg_put (b, MSG_SEXP);
+      msg_put (b, n);
+      msg_put (b, TO_SEXP(p)->tag);
+      break;
+
+    case CLOSURE_TAG:
+      msg_put (b, MSG_CLOSURE);
+      msg_put (b, n);
+      break;
+    }
+
+    for (j = 0; j < n; j++) {
+      void *f = ((void**) p)[j];
+
+      if (msg_in_heap (f)) {
+        msg_put (b, MSG_OBJECT);
+        msg_put (b, msg_number (&t, f));
+      }
+      else {
+        msg_put (b, MSG_VALUE);
+        msg_put (b, (int) f);
+      }
+    }
+  }
+
+  b->words[0] = t.n;
+
+  free (t.objs);
+  free (t.index);
+}
+
+/* Rebuilds a value out of a message in the heap of the current thread; the
+   caller has to call __pre_gc. The objects are allocated first (their
+   numbers are kept in an array in the heap, which is the only extra root),
+   then their fields are filled in */
+static void* msg_decode (msg_buf *b) {
+  int  *w = b->words, n = w[0], i, j, k, len;
+  void *objs, *x;
+
+  if (n == 0) return (void*) w[1];
+
+  objs = LmakeArray (BOX(n));
+  push_extra_root (&objs);
+
+  for (i = 0, k = 1; i < n; i++) {
+    len = w[k+1];
+
+    switch (w[k]) {
+    case MSG_STRING:
+      x  = LmakeString (BOX(len));
+      memcpy (x, w + k + 2, len);
+      k += 2 + MSG_WORDS(len);
+      break;
+
+    case MSG_ARRAY:
+      x  = LmakeArray (BOX(len));
+      k += 2 + 2 * len;
+      break;
+
+    case MSG_SEXP: {
+      sexp *r = (sexp*) alloc (sizeof (int) * (len + 2));
+
+      r->tag          = w[k+2];
+      r->contents.tag = SEXP_TAG | (len << 3);
+      x               = r->contents.contents;
+      for (j = 0; j < len; j++) ((int*) x)[j] = BOX(0);
+      ALLOC_PROF (x);
+      k += 3 + 2 * len;
+      break;
+    }
+
+    case MSG_CLOSURE: {
+      data *r = (data*) alloc (sizeof (int) * (len + 1));
+
+      r->tag = CLOSURE_TAG | (len << 3);
+      x      = r->contents;
+      for (j = 0; j < len; j++) ((int*) x)[j] = BOX(0);
+      ALLOC_PROF (x);
+      k += 2 + 2 * len;
+      break;
+    }
+
+    default:
+      failure ("spawn/join: malformed message\n");
+    }
+
+    ((void**) objs)[i] = x;
+  }
+
+  for (i = 0, k = 1; i < n; i++) {
+    len = w[k+1];
+
+    switch (w[k]) {
+    case MSG_STRING: k += 2 + MSG_WORDS(len); continue;
+    case MSG_SEXP  : k += 3; break;
+    default        : k += 2;
+    }
+
+    for (x = ((void**) objs)[i], j = 0; j < len; j++, k += 2)
+      ((void**) x)[j] = w[k] == MSG_OBJECT ? ((void**) objs)[w[k+1]] : (void*) w[k+1];
+  }
+
+  pop_extra_root (&objs);
+
+  return ((void**) objs)[0];
+}
+
+/* The initial size (in words) of the semispaces of a task */
+# define TASK_SPACE_SIZE (4 * 1024 * 1024)
+
+typedef struct task {
+  pthread_t    thread;
+  msg_buf      msg;     /* the function of the task, then its result */
+  struct task *next;    /* the list of the tasks not joined yet */
+} task;
+
+static          task *tasks   = NULL;  /* under runtime_lock */
+static __thread int   in_task = 0;
+
+/* Fails if a global variable refers to the heap of the current task */
+static void task_check_globals (void) {
+  extern const size_t __start_custom_data, __stop_custom_data;
+  size_t *p;
+
+  for (p = (size_t*) &__start_custom_data; p < (size_t*) &__stop_custom_data; p++)
+    if (msg_in_heap ((void*) *p))
+      failure ("spawn: a task has stored a boxed value into a global variable\n");
+}
+
+extern int __call_closure0 (void *closure);
+
+static void init_heap         (size_t size);
+static void free_thread_state (void);
+static void prof_thread_begin (void);
+static void prof_thread_end   (void);
+
+static void* task_run (void *arg) {
+  task *t = (task*) arg;
+  void *f;
+
+  // the stack of the task ends with this frame (see __gc_init)
+  __gc_stack_bottom = (size_t) __builtin_frame_address (0) + sizeof (size_t);
+
+  init_heap (TASK_SPACE_SIZE);
+  prof_thread_begin ();
+  in_task = 1;
+
+  __pre_gc ();
+  f = msg_decode (&t->msg);
+  __post_gc ();
+
+  t->msg.len = 0;
+  msg_encode (&t->msg, (void*) __call_closure0 (f));
+
+  task_check_globals ();
+  prof_thread_end ();
+  free_thread_state ();
+
+  return NULL;
+}
+
+/* Runs the closure f in a new thread; returns a handle [task] for join */
+extern void* Lspawn (void *f) {
+  task *t;
+  void *h;
+
+  check_closure ("spawn", f);
+
+  if ((t = (task*) calloc (1, sizeof (task))) == NULL) failure ("spawn: out of memory\n");
+
+  msg_encode (&t->msg, f);
+
+  if ((errno = pthread_create (&t->thread, NULL, task_run, t)) != 0)
+    failure ("spawn: %s\n", strerror (errno));
+
+  pthread_mutex_lock (&runtime_lock);
+  t->next = tasks;
+  tasks   = t;
+  pthread_mutex_unlock (&runtime_lock);
+
+  __pre_gc ();
+
+  h = LmakeArray (BOX(1));
+  ((task**) h)[0] = t;
+
+  __post_gc ();
+
+  return h;
+}
+
+/* Waits for the task with the handle h and returns (a copy of) its result */
+extern void* Ljoin (void *h) {
+  task *t, **q;
+  void *x;
+  int   found;
+
+  ASSERT_BOXED("join:1", h);
+
+  if (TAG(TO_DATA(h)->tag) != ARRAY_TAG || LEN(TO_DATA(h)->tag) != 1)
+    failure ("join: not a task handle\n");
+
+  // the handle is valid if it refers to a task which is not joined yet
+  t = ((task**) h)[0];
+
+  pthread_mutex_lock (&runtime_lock);
+  for (q = &tasks; *q != NULL && *q != t; q = &(*q)->next);
+  if ((found = *q != NULL)) *q = t->next;
+  pthread_mutex_unlock (&runtime_lock);
+
+  if (! found) failure ("join: not a task handle, or the task has been joined already\n");
+
+  if ((errno = pthread_join (t->thread, NULL)) != 0)
+    failure ("join: %s\n", strerror (errno));
+
+  ((int*) h)[0] = BOX(0);
+
+  __pre_gc ();
+
+  x = msg_decode (&t->msg);
+
+  __post_gc ();
+
+  free (t->msg.words);
+  free (t);
+
+  return x;
+}
+
+/* Sampling profiler. When the environment variable LAMA_PROF is set, the
+   program is interrupted LAMA_PROF_HZ (1000 by default) times per second of
+   CPU time, and the call stack is recorded by walking the chain of %ebp. At
+   exit, the samples are written into the file LAMA_PROF_FILE
+   ("lama-prof.folded" by default) in the folded stacks format, accepted by
+   flame graph tools: a line "frame;...;frame count" per distinct stack,
+   outermost frame first. Frames are named after Lama functions with their
+   source files and lines, which the compiler records in the sections
+   lama_funcs and lama_lines (see X86.prof_name); other code is shown as
+   "[native]".
+
+   The signal interrupts the thread which runs, and the handler walks the
+   stack of this thread. Each thread records its samples into a table of its
+   own (the handler must not lock); when a task finishes, its table is added
+   to the table of the program under runtime_lock. The samples of the tasks
+   which are still running at exit are not reported. */
+
+typedef struct {
+  size_t begin, end;
+  char  *name, *file;
+  int    closure;        /* the closure register is saved before %ebp */
+} prof_func;
+
+typedef struct {
+  size_t addr;
+  int    line;
+} prof_line;
+
+extern prof_func __start_lama_funcs[] __attribute__((weak)), __stop_lama_funcs[] __attribute__((weak));
+extern prof_line __start_lama_lines[] __attribute__((weak)), __stop_lama_lines[] __attribute__((weak));
+
+# define PROF_DEPTH  64
+# define PROF_STACKS 16384
+
+/* The samples of a thread: PROF_STACKS records (the depth, then PROF_DEPTH
+   addresses) and their counts */
+typedef struct {
+  size_t *stacks;
+  int    *counts;
+  int     lost;
+} prof_table;
+
+static           int        prof_enabled = 0;
+static           prof_table prof_all     = {NULL, NULL, 0};  /* the samples of the finished tasks */
+static __thread  prof_table prof_own     = {NULL, NULL, 0};  /* the samples of the current thread */
+static           int        prof_nfuncs  = 0, prof_nlines = 0;
+
+static int prof_func_compare (const void *a, const void *b) {
+  size_t x = ((prof_func*) a)->begin, y = ((prof_func*) b)->begin;
+  return x < y ? -1 : x > y;
+}
+
+static int prof_line_compare (const void *a, const void *b) {
+  size_t x = ((prof_line*) a)->addr, y = ((prof_line*) b)->addr;
+  return x < y ? -1 : x > y;
+}
+
+/* Sorts the tables of functions and lines for lookups */
+static void prof_tables (void) {
+  static int sorted = 0;
+
+  if (sorted) return;
+
+  sorted = 1;
+
+  if (__start_lama_funcs && __stop_lama_funcs) {
+    prof_nfuncs = __stop_lama_funcs - __start_lama_funcs;
+    qsort (__start_lama_funcs, prof_nfuncs, sizeof (prof_func), prof_func_compare);
+  }
+
+  if (__start_lama_lines && __stop_lama_lines) {
+    prof_nlines = __stop_lama_lines - __start_lama_lines;
+    qsort (__start_lama_lines, prof_nlines, sizeof (prof_line), prof_line_compare);
+  }
+}
+
+static prof_func* prof_find_func (size_t pc) {
+  int l = 0, r = prof_nfuncs;
+
+  while (l < r) {
+    int m = (l + r) / 2;
+
+    if (__start_lama_funcs[m].begin <= pc) l = m + 1; else r = m;
+  }
+
+  if (l > 0 && pc < __start_lama_funcs[l-1].end) return &__start_lama_funcs[l-1];
+
+  return NULL;
+}
+
+static prof_line* prof_find_line (size_t pc) {
+  int l = 0, r = prof_nlines;
+
+  while (l < r) {
+    int m = (l + r) / 2;
+
+    if (__start_lama_lines[m].addr <= pc) l = m + 1; else r = m;
+  }
+
+  return l > 0 ? &__start_lama_lines[l-1] : NULL;
+}
+
+/* Creates an empty table */
+static void prof_table_init (prof_table *t) {
+  t->stacks = (size_t*) malloc (PROF_STACKS * (PROF_DEPTH + 1) * sizeof (size_t));
+  t->counts = (int*) calloc (PROF_STACKS, sizeof (int));
+  t->lost   = 0;
+
+  if (t->stacks == NULL || t->counts == NULL) failure ("LAMA_PROF: out of memory\n");
+}
+
+/* Accounts count samples of the stack pcs of depth n in a table; returns 0
+   if the table is full */
+static int prof_table_add (prof_table *t, size_t *pcs, int n, int count) {
+  unsigned h = 0;
+  int      i, k;
+
+  for (i=0; i<n; i++) h = h * 31 + pcs[i];
+
+  for (k=0; k<PROF_STACKS; k++) {
+    size_t *e = t->stacks + ((h + k) % PROF_STACKS) * (PROF_DEPTH + 1);
+    int    *c = t->counts + (h + k) % PROF_STACKS;
+
+    if (*c == 0) {
+      e[0] = n;
+      memcpy (e + 1, pcs, n * sizeof (size_t));
+      *c = count;
+      return 1;
+    }
+
+    if (e[0] == n && memcmp (e + 1, pcs, n * sizeof (size_t)) == 0) {
+      *c += count;
+      return 1;
+    }
   }
+
+  return 0;
 }
 
-extern void* Belem (void *p, int i) {
-  data *a = (data *)BOX(NULL);
+/* Adds the samples of the current thread to the samples of the program and
+   releases the table of the thread */
+static void prof_merge (void) {
+  sigset_t s;
+  int      i;
 
-  ASSERT_BOXED(".elem:1", p);
-  ASSERT_UNBOXED(".elem:2", i);
-  
-  a = TO_DATA(p);
-  i = UNBOX(i);
-  
-  if (TAG(a->tag) == STRING_TAG) {
-    return (void*) BOX(a->contents[i]);
-  }
-  
-  return (void*) ((int*) a->contents)[i];
-}
+  if (prof_own.counts == NULL) return;
 
-extern void* LmakeArray (int length) {
-  data *r;
-  int n, *p;
+  sigemptyset (&s);
+  sigaddset   (&s, SIGPROF);
+  pthread_sigmask (SIG_BLOCK, &s, NULL);
 
-  ASSERT_UNBOXED("makeArray:1", length);
-  
-  __pre_gc ();
+  pthread_mutex_lock (&runtime_lock);
 
-  n = UNBOX(length);
-  r = (data*) alloc (sizeof(int) * (n+1));
+  for (i=0; i<PROF_STACKS; i++) {
+    size_t *e = prof_own.stacks + i * (PROF_DEPTH + 1);
 
-  r->tag = ARRAY_TAG | (n << 3);
+    if (prof_own.counts[i] && ! prof_table_add (&prof_all, e + 1, e[0], prof_own.counts[i]))
+      prof_all.lost += prof_own.counts[i];
+  }
 
-  p = (int*) r->contents;
-  while (n--) *p++ = BOX(0);
-  
-  __post_gc ();
+  prof_all.lost += prof_own.lost;
 
-  return r->contents;
-}
+  pthread_mutex_unlock (&runtime_lock);
 
-extern void* LmakeString (int length) {
-  int   n = UNBOX(length);
-  data *r;
+  free (prof_own.stacks);
+  free (prof_own.counts);
+  prof_own.stacks = NULL;
+  prof_own.counts = NULL;
+}
 
-  ASSERT_UNBOXED("makeString", length);
-  
-  __pre_gc () ;
-  
-  r = (data*) alloc (n + 1 + sizeof (int));
+/* Starts sampling a new thread (a task) */
+static void prof_thread_begin (void) {
+  prof_table t;
 
-  r->tag = STRING_TAG | (n << 3);
+  if (! prof_enabled) return;
 
-  __post_gc();
-  
-  return r->contents;
+  prof_table_init (&t);
+  prof_own.lost   = 0;
+  prof_own.stacks = t.stacks;
+  prof_own.counts = t.counts;
 }
 
-extern void* Bstring (void *p) {
-  int   n = strlen (p);
-  data *s = NULL;
-  
-  __pre_gc ();
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("Bstring: call LmakeString %s %p %p %p %i\n", p, &p, p, s, n);
-  fflush(stdout);
-#endif
-  push_extra_root (&p);
-  s = LmakeString (BOX(n));  
-  pop_extra_root(&p);
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("\tBstring: call strncpy: %p %p %p %i\n", &p, p, s, n); fflush(stdout);
-#endif
-  strncpy ((char*)s, p, n + 1);
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("\tBstring: ends\n"); fflush(stdout);
-  indent--;
-#endif
-  __post_gc ();
-  
-  return s;
+/* Stops sampling a thread (a task) which finishes */
+static void prof_thread_end (void) {
+  if (prof_enabled) prof_merge ();
 }
 
-extern void* Lstringcat (void *p) {
-  void *s;
+static void prof_handler (int sig, siginfo_t *info, void *context) {
+  mcontext_t *mc = &((ucontext_t*) context)->uc_mcontext;
+  size_t  pcs [PROF_DEPTH];
+  size_t  pc = mc->gregs[REG_EIP];
+  size_t *bp = (size_t*) mc->gregs[REG_EBP];
+  size_t *sp = (size_t*) mc->gregs[REG_ESP];
+  int     n  = 0;
 
-  /* ASSERT_BOXED("stringcat", p); */
-  
-  __pre_gc ();
-  
-  createStringBuf ();
-  stringcat (p);
+  // the thread has not started (or has already finished) sampling
+  if (prof_own.counts == NULL) return;
 
-  push_extra_root(&p);
-  s = Bstring (stringBuf.contents);
-  pop_extra_root(&p);
-  
-  deleteStringBuf ();
+  pcs[n++] = pc;
 
-  __post_gc ();
+  while (n < PROF_DEPTH && bp >= sp && bp + 2 < (size_t*) __gc_stack_bottom && ((size_t) bp & 3) == 0) {
+    prof_func *f    = prof_find_func (pc);
+    size_t    *next = (size_t*) bp[0];
 
-  return s;  
-}
+    pc = (f && f->closure) ? bp[2] : bp[1];
+    pcs[n++] = pc;
 
-extern void* Lstring (void *p) {
-  void *s = (void *) BOX (NULL);
+    if (next <= bp) break;
 
-  __pre_gc () ;
-  
-  createStringBuf ();
-  printValue (p);
+    bp = next;
+  }
 
-  push_extra_root(&p);
-  s = Bstring (stringBuf.contents);
-  pop_extra_root(&p);
-  
-  deleteStringBuf ();
+  if (! prof_table_add (&prof_own, pcs, n, 1)) prof_own.lost++;
+}
 
-  __post_gc ();
+static void prof_frame (FILE *f, size_t pc) {
+  prof_func *fn = prof_find_func (pc);
+  prof_line *l  = prof_find_line (pc);
 
-  return s;
+  if (fn == NULL) fprintf (f, "[native]");
+  else if (l && l->addr >= fn->begin) fprintf (f, "%s (%s:%d)", fn->name, fn->file, l->line);
+  else fprintf (f, "%s (%s)", fn->name, fn->file);
 }
 
-extern void* Bclosure (int bn, void *entry, ...) {
-  va_list args; 
-  int     i, ai;
-  register int * ebp asm ("ebp");
-  size_t  *argss;
-  data    *r; 
-  int     n = UNBOX(bn);
-  
-  __pre_gc ();
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("Bclosure: create n = %d\n", n); fflush(stdout);
-#endif
-  argss = (ebp + 12);
-  for (i = 0; i<n; i++, argss++) {
-    push_extra_root ((void**)argss);
-  }
+static void prof_dump (void) {
+  struct itimerval t;
+  char *name = getenv ("LAMA_PROF_FILE");
+  FILE *f;
+  int   i, j;
 
-  r = (data*) alloc (sizeof(int) * (n+2));
-  
-  r->tag = CLOSURE_TAG | ((n + 1) << 3);
-  ((void**) r->contents)[0] = entry;
-  
-  va_start(args, entry);
-  
-  for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i+1] = ai;
-  }
-  
-  va_end(args);
+  memset (&t, 0, sizeof (t));
+  setitimer (ITIMER_PROF, &t, NULL);
 
-  __post_gc();
+  prof_merge ();
 
-  argss--;
-  for (i = 0; i<n; i++, argss--) {
-    pop_extra_root ((void**)argss);
+  if ((f = fopen (name ? name : "lama-prof.folded", "w")) == NULL) {
+    fprintf (stderr, "LAMA_PROF: could not write the profile: %s\n", strerror (errno));
+    return;
   }
 
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("Bclosure: ends\n", n); fflush(stdout);
-  indent--;
-#endif
+  pthread_mutex_lock (&runtime_lock);
 
-  return r->contents;
-}
+  for (i=0; i<PROF_STACKS; i++) {
+    size_t *e = prof_all.stacks + i * (PROF_DEPTH + 1);
 
-extern void* Barray (int bn, ...) {
-  va_list args; 
-  int     i, ai; 
-  data    *r; 
-  int     n = UNBOX(bn);
-    
-  __pre_gc ();
-  
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("Barray: create n = %d\n", n); fflush(stdout);
-#endif
-  r = (data*) alloc (sizeof(int) * (n+1));
+    if (prof_all.counts[i] == 0) continue;
 
-  r->tag = ARRAY_TAG | (n << 3);
-  
-  va_start(args, bn);
-  
-  for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i] = ai;
+    for (j=e[0]; j>0; j--) {
+      /* return addresses point past the calls */
+      prof_frame (f, j == 1 ? e[j] : e[j] - 1);
+      fputc (j == 1 ? ' ' : ';', f);
+    }
+
+    fprintf (f, "%d\n", prof_all.counts[i]);
   }
-  
-  va_end(args);
 
-  __post_gc();
-#ifdef DEBUG_PRINT
-  indent--;
-#endif
-  return r->contents;
+  if (prof_all.lost) fprintf (f, "[lost] %d\n", prof_all.lost);
+
+  pthread_mutex_unlock (&runtime_lock);
+
+  fclose (f);
 }
 
-extern void* Bsexp (int bn, ...) {
-  va_list args; 
-  int     i;    
-  int     ai;  
-  size_t *p;  
-  sexp   *r;  
-  data   *d;  
-  int n = UNBOX(bn); 
+static void __attribute__((constructor)) prof_init (void) {
+  struct sigaction  sa;
+  struct itimerval  t;
+  char             *hz = getenv ("LAMA_PROF_HZ");
+  int               n  = hz ? atoi (hz) : 1000;
 
-  __pre_gc () ;
-  
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf("Bsexp: allocate %zu!\n",sizeof(int) * (n+1)); fflush (stdout);
-#endif
-  r = (sexp*) alloc (sizeof(int) * (n+1));
-  d = &(r->contents);
-  r->tag = 0;
-    
-  d->tag = SEXP_TAG | ((n-1) << 3);
-  
-  va_start(args, bn);
-  
-  for (i=0; i<n-1; i++) {
-    ai = va_arg(args, int);
-    
-    p = (size_t*) ai;
-    ((int*)d->contents)[i] = ai;
-  }
+  if (getenv ("LAMA_PROF") == NULL) return;
 
-  r->tag = UNBOX(va_arg(args, int));
+  if (n <= 0 || n > 1000000) n = 1000;
 
-#ifdef DEBUG_PRINT
-  r->tag = SEXP_TAG | ((r->tag) << 3);
-  print_indent ();
-  printf("Bsexp: ends\n"); fflush (stdout);
-  indent--;
-#endif
+  prof_tables ();
 
-  va_end(args);
+  prof_table_init (&prof_all);
+  prof_table_init (&prof_own);
+  prof_enabled = 1;
 
-  __post_gc();
+  atexit (prof_dump);
 
-  return d->contents;
-}
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_sigaction = prof_handler;
+  sa.sa_flags     = SA_SIGINFO | SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGPROF, &sa, NULL);
 
-extern int Btag (void *d, int t, int n) {
-  data *r; 
-  
-  if (UNBOXED(d)) return BOX(0);
-  else {
-    r = TO_DATA(d);
-#ifndef DEBUG_PRINT
-    return BOX(TAG(r->tag) == SEXP_TAG && TO_SEXP(d)->tag == UNBOX(t) && LEN(r->tag) == UNBOX(n));
-#else
-    return BOX(TAG(r->tag) == SEXP_TAG &&
-               GET_SEXP_TAG(TO_SEXP(d)->tag) == UNBOX(t) && LEN(r->tag) == UNBOX(n));
-#endif
-  }
+  t.it_interval.tv_sec  = 0;
+  t.it_interval.tv_usec = 1000000 / n;
+  t.it_value            = t.it_interval;
+  setitimer (ITIMER_PROF, &t, NULL);
 }
 
-extern int Barray_patt (void *d, int n) {
-  data *r; 
-  
-  if (UNBOXED(d)) return BOX(0);
-  else {
-    r = TO_DATA(d);
-    return BOX(TAG(r->tag) == ARRAY_TAG && LEN(r->tag) == UNBOX(n));
-  }
-}
+# ifdef LAMA_ALLOC_PROF
 
-extern int Bstring_patt (void *x, void *y) {
-  data *rx = (data *) BOX (NULL),
-       *ry = (data *) BOX (NULL);
-  
-  ASSERT_STRING(".string_patt:2", y);
-      
-  if (UNBOXED(x)) return BOX(0);
-  else {
-    rx = TO_DATA(x); ry = TO_DATA(y);
+/* Allocation profiler, compiled in the runtime built with LAMA_ALLOC_PROF
+   ("make alloc-prof"). Allocated objects are accounted per allocation site
+   (the innermost return address into Lama code), kind and, for
+   S-expressions, constructor. The objects are sampled every
+   LAMA_ALLOC_PROF_RATE bytes (by default, every object is counted); a sample
+   accounts for all the bytes allocated since the previous one. At exit, the
+   sites are written, the most allocating first, into the file
+   LAMA_ALLOC_PROF_FILE ("lama-alloc.prof" by default).
 
-    if (TAG(rx->tag) != STRING_TAG) return BOX(0);
-    
-    return BOX(strcmp (rx->contents, ry->contents) == 0 ? 1 : 0);
-  }
-}
+   The sites of all threads are accounted in one table under runtime_lock;
+   the bytes pending for a sample and the stack walked to find the site are
+   those of the current thread. */
 
-extern int Bclosure_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
-  
-  return BOX(TAG(TO_DATA(x)->tag) == CLOSURE_TAG);
+typedef struct {
+  size_t    site;
+  int       kind, ctag;
+  int       count;
+  long long bytes;
+} alloc_site;
+
+# define ALLOC_SITES 65536
+
+static          alloc_site *alloc_sites   = NULL;
+static          long long   alloc_rate    = 1;
+static __thread long long   alloc_pending = 0;
+static          int         alloc_lost    = 0;
+
+static int alloc_site_compare (const void *a, const void *b) {
+  long long x = ((alloc_site*) a)->bytes, y = ((alloc_site*) b)->bytes;
+  return x > y ? -1 : x < y;
 }
 
-extern int Bboxed_patt (void *x) {
-  return BOX(UNBOXED(x) ? 0 : 1);
-}
+static void alloc_prof_dump (void) {
+  char *name = getenv ("LAMA_ALLOC_PROF_FILE");
+  FILE *f;
+  int   i, n = 0;
 
-extern int Bunboxed_patt (void *x) {
-  return BOX(UNBOXED(x) ? 1 : 0);
-}
+  if ((f = fopen (name ? name : "lama-alloc.prof", "w")) == NULL) {
+    fprintf (stderr, "LAMA_ALLOC_PROF: could not write the profile: %s\n", strerror (errno));
+    return;
+  }
 
-extern int Barray_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
-  
-  return BOX(TAG(TO_DATA(x)->tag) == ARRAY_TAG);
-}
+  pthread_mutex_lock (&runtime_lock);
 
-extern int Bstring_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
-  
-  return BOX(TAG(TO_DATA(x)->tag) == STRING_TAG);
-}
+  for (i=0; i<ALLOC_SITES; i++)
+    if (alloc_sites[i].count) alloc_sites[n++] = alloc_sites[i];
 
-extern int Bsexp_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
-  
-  return BOX(TAG(TO_DATA(x)->tag) == SEXP_TAG);
-}
+  qsort (alloc_sites, n, sizeof (alloc_site), alloc_site_compare);
 
-extern void* Bsta (void *v, int i, void *x) {
-  if (UNBOXED(i)) {
-    ASSERT_BOXED(".sta:3", x);
-    //    ASSERT_UNBOXED(".sta:2", i);
-  
-    if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
-    else ((int*) x)[UNBOX(i)] = (int) v;
+  fprintf (f, "# bytes\tobjects\tkind\tconstructor\tsite\n");
 
-    return v;
+  for (i=0; i<n; i++) {
+    alloc_site *s = &alloc_sites[i];
+
+    fprintf (f, "%lld\t%d\t%s\t%s\t",
+             s->bytes,
+             s->count,
+             s->kind == STRING_TAG ? "string" : s->kind == ARRAY_TAG ? "array" : s->kind == SEXP_TAG ? "sexp" : "closure",
+             s->kind == SEXP_TAG ? de_hash (s->ctag) : "-");
+    prof_frame (f, s->site - 1);
+    fputc ('\n', f);
   }
 
-  * (void**) x = v;
+  if (alloc_lost) fprintf (f, "# %d samples lost\n", alloc_lost);
 
-  return v;
-}
+  pthread_mutex_unlock (&runtime_lock);
 
-static void fix_unboxed (char *s, va_list va) {
-  size_t *p = (size_t*)va;
-  int i = 0;
-  
-  while (*s) {
-    if (*s == '%') {
-      size_t n = p [i];
-      if (UNBOXED (n)) {
-	p[i] = UNBOX(n);
-      }
-      i++;
-    }
-    s++;
-  } 
+  fclose (f);
 }
 
-extern void Lfailure (char *s, ...) {
-  va_list args;
-  
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  vfailure    (s, args);
-}
+static void alloc_prof_init (void) {
+  char *rate = getenv ("LAMA_ALLOC_PROF_RATE");
 
-extern void Bmatch_failure (void *v, char *fname, int line, int col) {
-  createStringBuf ();
-  printValue (v);
-  failure ("match failure at %s:%d:%d, value '%s'\n",
-	   fname, UNBOX(line), UNBOX(col), stringBuf.contents);
+  if (rate && atoll (rate) > 0) alloc_rate = atoll (rate);
+
+  prof_tables ();
+
+  alloc_sites = (alloc_site*) calloc (ALLOC_SITES, sizeof (alloc_site));
+
+  if (alloc_sites == NULL) failure ("LAMA_ALLOC_PROF: out of memory\n");
+
+  atexit (alloc_prof_dump);
 }
 
-extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
-  data *da = (data*) BOX (NULL);
-  data *db = (data*) BOX (NULL);
-  data *d  = (data*) BOX (NULL);
+/* The innermost return address into Lama code on the stack */
+static size_t alloc_prof_site (void) {
+  size_t *bp = (size_t*) __builtin_frame_address (0), first = 0;
+  int     i;
 
-  ASSERT_STRING("++:1", a);
-  ASSERT_STRING("++:2", b);
-  
-  da = TO_DATA(a);
-  db = TO_DATA(b);
+  for (i=0; i<16 && bp && bp + 1 < (size_t*) __gc_stack_bottom; i++) {
+    size_t *next = (size_t*) bp[0];
 
-  __pre_gc () ;
+    if (! first) first = bp[1];
 
-  push_extra_root (&a);
-  push_extra_root (&b);
-  d  = (data *) alloc (sizeof(int) + LEN(da->tag) + LEN(db->tag) + 1);
-  pop_extra_root (&b);
-  pop_extra_root (&a);
+    if (prof_find_func (bp[1])) return bp[1];
 
-  da = TO_DATA(a);
-  db = TO_DATA(b);
-  
-  d->tag = STRING_TAG | ((LEN(da->tag) + LEN(db->tag)) << 3);
+    if (next <= bp) break;
 
-  strncpy (d->contents               , da->contents, LEN(da->tag));
-  strncpy (d->contents + LEN(da->tag), db->contents, LEN(db->tag));
-  
-  d->contents[LEN(da->tag) + LEN(db->tag)] = 0;
+    bp = next;
+  }
 
-  __post_gc();
-  
-  return d->contents;
+  return first;
 }
 
-extern void* Lsprintf (char * fmt, ...) {
-  va_list args;
-  void *s;
-
-  ASSERT_STRING("sprintf:1", fmt);
-  
-  va_start (args, fmt);
-  fix_unboxed (fmt, args);
-  
-  createStringBuf ();
+static void alloc_prof_record (void *p) {
+  data     *d    = TO_DATA(p);
+  int       kind = TAG(d->tag), ctag = kind == SEXP_TAG ? TO_SEXP(p)->tag : 0, k;
+  size_t    site;
+  unsigned  h;
 
-  vprintStringBuf (fmt, args);
+  alloc_pending += kind == STRING_TAG ? sizeof (int) + LEN(d->tag) + 1
+                 : (LEN(d->tag) + (kind == SEXP_TAG ? 2 : 1)) * sizeof (int);
 
-  __pre_gc ();
+  if (alloc_pending < alloc_rate) return;
 
-  push_extra_root ((void**)&fmt);
-  s = Bstring (stringBuf.contents);
-  pop_extra_root ((void**)&fmt);
+  site = alloc_prof_site ();
+  h    = (site * 31 + kind) * 31 + ctag;
 
-  __post_gc ();
-  
-  deleteStringBuf ();
+  pthread_mutex_lock (&runtime_lock);
 
-  return s;
-}
+  if (alloc_sites == NULL) alloc_prof_init ();
 
-extern void* LgetEnv (char *var) {
-  char *e = getenv (var);
-  void *s;
-  
-  if (e == NULL)
-    return BOX(0);
+  for (k=0; k<ALLOC_SITES; k++) {
+    alloc_site *s = &alloc_sites[(h + k) % ALLOC_SITES];
 
-  __pre_gc ();
+    if (s->count == 0) {
+      s->site = site;
+      s->kind = kind;
+      s->ctag = ctag;
+    }
 
-  s = Bstring (e);
+    if (s->site == site && s->kind == kind && s->ctag == ctag) {
+      s->count++;
+      s->bytes += alloc_pending;
+      alloc_pending = 0;
+      pthread_mutex_unlock (&runtime_lock);
+      return;
+    }
+  }
 
-  __post_gc ();
+  alloc_lost++;
+  alloc_pending = 0;
 
-  return s;
+  pthread_mutex_unlock (&runtime_lock);
 }
 
-extern int Lsystem (char *cmd) {
-  return BOX (system (cmd));
-}
+# endif
 
 extern void Lfprintf (FILE *f, char *s, ...) {
   va_list args = (va_list) BOX (NULL);
@@ -1332,10 +3487,16 @@ extern void Lfprintf (FILE *f, char *s, ...) {
   
   va_start    (args, s);
   fix_unboxed (s, args);
+
+  createStringBuf ();
+  vprintStringBuf (s, args);
+  va_end (args);
   
-  if (vfprintf (f, s, args) < 0) {
+  if (fwrite (stringBuf.contents, 1, stringBuf.ptr, f) != stringBuf.ptr) {
     failure ("fprintf (...): %s\n", strerror (errno));
   }
+
+  deleteStringBuf ();
 }
 
 extern void Lprintf (char *s, ...) {
@@ -1345,14 +3506,44 @@ extern void Lprintf (char *s, ...) {
 
   va_start    (args, s);
   fix_unboxed (s, args);
+
+  createStringBuf ();
+  vprintStringBuf (s, args);
+  va_end (args);
   
-  if (vprintf (s, args) < 0) {
-    failure ("fprintf (...): %s\n", strerror (errno));
+  if (fwrite (stringBuf.contents, 1, stringBuf.ptr, stdout) != stringBuf.ptr) {
+    failure ("printf (...): %s\n", strerror (errno));
   }
 
+  deleteStringBuf ();
+
   fflush (stdout);
 }
 
+/* Streaming I/O */
+
+# define FILE_BUFFER_SIZE (64 * 1024)
+
+static __thread char   *lineBuf      = NULL;
+static __thread size_t  lineBufSize  = 0;
+static __thread char   *chunkBuf     = NULL;
+static __thread size_t  chunkBufSize = 0;
+
+// Copies n bytes at p into a fresh string; p must not point into the heap
+static void* copyString (char *p, int n) {
+  void *s;
+
+  __pre_gc ();
+
+  s = LmakeString (BOX(n));
+  memcpy (s, p, n);
+  ((char*) s)[n] = 0;
+
+  __post_gc ();
+
+  return s;
+}
+
 extern FILE* Lfopen (char *f, char *m) {
   FILE* h;
 
@@ -1361,10 +3552,12 @@ extern FILE* Lfopen (char *f, char *m) {
 
   h = fopen (f, m);
   
-  if (h)
+  if (h) {
+    setvbuf (h, NULL, _IOFBF, FILE_BUFFER_SIZE);
     return h;
+  }
 
-  failure ("fopen (\"%s\", \"%s\"): %s, %s, %s\n", f, m, strerror (errno));
+  failure ("fopen (\"%s\", \"%s\"): %s\n", f, m, strerror (errno));
 }
 
 extern void Lfclose (FILE *f) {
@@ -1373,22 +3566,158 @@ extern void Lfclose (FILE *f) {
   fclose (f);
 }
 
-extern void* LreadLine () {
-  char *buf;
+// Reads a line (without the trailing newline) from a file; returns 0 at the
+// end of file. The line buffer is reused between calls
+extern void* LfreadLine (FILE *f) {
+  ssize_t n;
 
-  if (scanf ("%m[^\n]", &buf) == 1) {
-    void * s = Bstring (buf);
+  ASSERT_BOXED("freadLine", f);
 
-    getchar ();
-    
-    free (buf);
-    return s;
+  n = getline (&lineBuf, &lineBufSize, f);
+
+  if (n < 0) {
+    if (ferror (f))
+      failure ("freadLine (...): %s\n", strerror (errno));
+
+    return (void*) BOX (0);
   }
-  
-  if (errno != 0)
-    failure ("readLine (): %s\n", strerror (errno));
 
-  return (void*) BOX (0);
+  if (n > 0 && lineBuf[n-1] == '\n') n--;
+
+  return copyString (lineBuf, n);
+}
+
+// Reads at most n bytes from a file; returns 0 at the end of file
+extern void* LfreadChunk (FILE *f, int n) {
+  size_t m;
+
+  ASSERT_BOXED("freadChunk:1", f);
+  ASSERT_UNBOXED("freadChunk:2", n);
+
+  if (UNBOX(n) <= 0)
+    failure ("freadChunk (...): invalid chunk size %d\n", UNBOX(n));
+
+  if (chunkBufSize < UNBOX(n)) {
+    char *b = (char*) realloc (chunkBuf, UNBOX(n));
+
+    if (b == NULL)
+      failure ("freadChunk (...): could not allocate a buffer of %d bytes\n", UNBOX(n));
+
+    chunkBuf     = b;
+    chunkBufSize = UNBOX(n);
+  }
+
+  m = fread (chunkBuf, 1, UNBOX(n), f);
+
+  if (m == 0) {
+    if (ferror (f))
+      failure ("freadChunk (...): %s\n", strerror (errno));
+
+    return (void*) BOX (0);
+  }
+
+  return copyString (chunkBuf, m);
+}
+
+// Writes a string to a file (through the stdio buffer of the file)
+extern void LfwriteString (FILE *f, char *s) {
+  int n;
+
+  ASSERT_BOXED("fwriteString:1", f);
+  ASSERT_STRING("fwriteString:2", s);
+
+  n = LEN(TO_DATA(s)->tag);
+
+  if (fwrite (s, 1, n, f) != n)
+    failure ("fwriteString (...): %s\n", strerror (errno));
+}
+
+extern void Lfflush (FILE *f) {
+  ASSERT_BOXED("fflush", f);
+
+  if (fflush (f) != 0)
+    failure ("fflush (...): %s\n", strerror (errno));
+}
+
+/* Memory-mapped strings.
+
+   A file is mapped (privately, i.e. copy-on-write) right after a page which
+   holds the string header, thus the contents of the file is a regular string
+   residing outside the heap; the GC does not move nor reclaim it, and the
+   mapping lives until the program exits. The regions are registered so that
+   the functions which inspect values (compare, hash, string) can
+   recognize them.
+*/
+typedef struct mapped_region {
+  size_t                begin;
+  size_t                end;
+  struct mapped_region *next;
+} mapped_region;
+
+static mapped_region *mapped_regions = NULL;
+
+static int is_mapped_string (void *p) {
+  mapped_region *r;
+
+  for (r = mapped_regions; r; r = r->next)
+    if (r->begin <= (size_t) p && (size_t) p < r->end) return 1;
+
+  return 0;
+}
+
+extern void* Lfmap (char *fname) {
+  int            fd;
+  struct stat    st;
+  size_t         page = sysconf (_SC_PAGESIZE), size;
+  char          *base;
+  data          *d;
+  mapped_region *r;
+
+  ASSERT_STRING("fmap", fname);
+
+  if ((fd = open (fname, O_RDONLY)) < 0 || fstat (fd, &st) < 0)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  // the length of a string must fit into a header, which limits the mapped
+  // files to 256MB; larger files are to be read by freadLine/freadChunk
+  if (st.st_size >= (1 << 28))
+    failure ("fmap (\"%s\"): file is too large (256MB at most)\n", fname);
+
+  // a header page, the contents and at least one terminating zero
+  size = page + ((st.st_size + page) / page) * page;
+  base = mmap (NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+
+  if (base == MAP_FAILED)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  if (st.st_size > 0 &&
+      mmap (base + page, st.st_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  close (fd);
+
+  d      = (data*) (base + page - sizeof (int));
+  d->tag = STRING_TAG | (st.st_size << 3);
+
+  if ((r = (mapped_region*) malloc (sizeof (mapped_region))) == NULL)
+    failure ("fmap (\"%s\"): out of memory\n", fname);
+
+  r->begin = (size_t) d->contents;
+  r->end   = (size_t) (base + size);
+
+  // the list is only extended at the head, thus it can be read without the lock
+  pthread_mutex_lock (&runtime_lock);
+  r->next        = mapped_regions;
+  mapped_regions = r;
+  pthread_mutex_unlock (&runtime_lock);
+
+  return d->contents;
+}
+
+extern void* LreadLine () {
+  return LfreadLine (stdin);
 }
 
 extern void* Lfread (char *fname) {
@@ -1424,11 +3753,10 @@ extern void Lfwrite (char *fname, char *contents) {
   f = fopen (fname, "w");
 
   if (f) {
-    if (fprintf (f, "%s", contents) < 0);
-    else {
-      fclose (f);
-      return;
-    }
+    int n = LEN(TO_DATA(contents)->tag);
+
+    if (fwrite (contents, 1, n, f) != n) fclose (f);
+    else if (fclose (f) == 0) return;
   }
 
   failure ("fwrite (\"%s\"): %s\n", fname, strerror (errno));
@@ -1568,17 +3896,120 @@ void __gc_init_subst () {}
 
 extern void __gc_root_scan_stack ();
 
+/* Runtime statistics. When the environment variable LAMA_STATS is set, the
+   runtime counts the collections, the bytes allocated and copied by the GC
+   and the time spent in it, and, if perf_event_open is available, the
+   instructions retired in user mode (in all threads). At exit, the counters
+   are written as "name value" lines into the file LAMA_STATS names (to
+   stderr if it is empty). performance/bench.sh uses them to compare runs
+   against the baselines. */
+
+static int        stats           = 0;
+static int        stats_insns_fd  = -1;
+static long long  stats_allocated = 0, stats_copied = 0, stats_max_live = 0;  /* in words */
+static int        stats_collections = 0;
+static double     stats_gc_time   = 0;
+
+/* The heap of each thread is accounted separately */
+static __thread size_t *stats_base = NULL;  /* from_space.current after the last collection */
+static __thread double  stats_gc_start;
+
+static double stats_now (void) {
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Accounts for the allocations in the heap of the thread since the last
+   collection */
+static void stats_heap_allocated (void) {
+  if (from_space.current == NULL) return;
+
+  if (stats_base == NULL) stats_base = from_space.begin;
+
+  pthread_mutex_lock (&runtime_lock);
+  stats_allocated += from_space.current - stats_base;
+  pthread_mutex_unlock (&runtime_lock);
+
+  stats_base = from_space.current;
+}
+
+static void stats_gc_begin (void) {
+  stats_heap_allocated ();
+  stats_gc_start = stats_now ();
+}
+
+/* The collection made room for an object of size words */
+static void stats_gc_end (size_t size) {
+  long long live = from_space.current - from_space.begin - size;
+
+  pthread_mutex_lock (&runtime_lock);
+  stats_collections++;
+  stats_copied += live;
+  if (live > stats_max_live) stats_max_live = live;
+  stats_gc_time += stats_now () - stats_gc_start;
+  pthread_mutex_unlock (&runtime_lock);
+
+  stats_base = from_space.current - size;
+}
+
+static void stats_dump (void) {
+  char      *name = getenv ("LAMA_STATS");
+  FILE      *f    = stderr;
+  long long  insns;
+
+  if (*name && (f = fopen (name, "w")) == NULL) {
+    fprintf (stderr, "LAMA_STATS: could not write the statistics: %s\n", strerror (errno));
+    return;
+  }
+
+  stats_heap_allocated ();
+
+  if (stats_insns_fd >= 0 && read (stats_insns_fd, &insns, sizeof (insns)) == sizeof (insns)) {
+    fprintf (f, "instructions %lld\n", insns);
+  }
+
+  fprintf (f, "gc_collections %d\n",   stats_collections);
+  fprintf (f, "gc_allocated %lld\n",   stats_allocated * sizeof (size_t));
+  fprintf (f, "gc_copied %lld\n",      stats_copied    * sizeof (size_t));
+  fprintf (f, "gc_max_live %lld\n",    stats_max_live  * sizeof (size_t));
+  fprintf (f, "gc_time %.6f\n",        stats_gc_time);
+
+  if (f != stderr) fclose (f);
+}
+
+static void __attribute__((constructor)) stats_init (void) {
+  struct perf_event_attr a;
+
+  if (getenv ("LAMA_STATS") == NULL) return;
+
+  stats = 1;
+
+  memset (&a, 0, sizeof (a));
+  a.type           = PERF_TYPE_HARDWARE;
+  a.size           = sizeof (a);
+  a.config         = PERF_COUNT_HW_INSTRUCTIONS;
+  a.exclude_kernel = 1;
+  a.exclude_hv     = 1;
+  a.inherit        = 1;  /* count the threads of the tasks as well */
+  stats_insns_fd   = syscall (__NR_perf_event_open, &a, 0, -1, -1, 0);
+
+  atexit (stats_dump);
+}
+
 /* ======================================== */
 /*           Mark-and-copy                  */
 /* ======================================== */
 
 //static size_t SPACE_SIZE = 16;
-static size_t SPACE_SIZE = 256 * 1024 * 1024;
+static __thread size_t SPACE_SIZE = 256 * 1024 * 1024;
 // static size_t SPACE_SIZE = 128;
 // static size_t SPACE_SIZE = 1024 * 1024;
 
 static int free_pool (pool * p) {
-  size_t *a = p->begin, b = p->size;
+  size_t *a = p->begin, b = p->size * sizeof (size_t);
   p->begin   = NULL;
   p->size    = 0;
   p->end     = NULL;
@@ -1632,8 +4063,10 @@ static void gc_swap_spaces (void) {
 # define IS_FORWARD_PTR(p)			\
   (!UNBOXED(p) && IN_PASSIVE_SPACE(p))
 
+// Checks if p points to a value which can be inspected (i.e. either to the
+// heap or to a memory-mapped string)
 int is_valid_heap_pointer (void *p)  {
-  return IS_VALID_HEAP_POINTER(p);
+  return IS_VALID_HEAP_POINTER(p) || (!UNBOXED(p) && is_mapped_string (p));
 }
 
 extern size_t * gc_copy (size_t *obj);
@@ -1792,8 +4225,9 @@ extern size_t * gc_copy (size_t *obj) {
       current += (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
       *copy = d->tag;
       copy++;
+      i = LEN(d->tag);
       d->tag = (int) copy;
-      strcpy ((char*)&copy[0], (char*) obj);
+      memcpy ((char*)&copy[0], (char*) obj, i + 1);
       break;
 
   case SEXP_TAG  :
@@ -1872,15 +4306,15 @@ static inline void init_extra_roots (void) {
   extra_roots.current_free = 0;
 }
 
-extern void __init (void) {
-  size_t space_size = SPACE_SIZE * sizeof(size_t);
+/* Creates the heap of the current thread with the semispaces of size words */
+static void init_heap (size_t size) {
+  size_t space_size = size * sizeof(size_t);
 
-  srandom (time (NULL));
-  
+  SPACE_SIZE       = size;
   from_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
     			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
   to_space.begin   = NULL;
-  if (to_space.begin == MAP_FAILED) {
+  if (from_space.begin == MAP_FAILED) {
     perror ("EROOR: init_pool: mmap failed\n");
     exit   (1);
   }
@@ -1893,6 +4327,23 @@ extern void __init (void) {
   init_extra_roots ();
 }
 
+extern void __init (void) {
+  srandom (time (NULL));
+  init_heap (SPACE_SIZE);
+}
+
+/* Releases the heap and the buffers of the current thread (of a task) */
+static void free_thread_state (void) {
+  if (stats) stats_heap_allocated ();
+
+  free_pool (&from_space);
+  if (to_space.begin) free_pool (&to_space);
+
+  free (stringBuf.contents);
+  free (lineBuf);
+  free (chunkBuf);
+}
+
 static void* gc (size_t size) {
   if (! enable_GC) {
     Lfailure ("GC disabled");
@@ -1907,6 +4358,7 @@ static void* gc (size_t size) {
 	  __gc_stack_top, __gc_stack_bottom);
   fflush (stdout);
 #endif
+  if (in_task) task_check_globals ();
   gc_root_scan_data ();
 #ifdef DEBUG_PRINT
   print_indent ();
@@ -2078,6 +4530,7 @@ extern void * alloc (size_t size) {
   }
 
   init_to_space (0);
+  if (stats) stats_gc_begin ();
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("alloc: call gc: %zu\n", size); fflush (stdout);
@@ -2088,9 +4541,10 @@ extern void * alloc (size_t size) {
 	 from_space.end, from_space.current, p); fflush (stdout);
   printFromSpace(); fflush (stdout);
   indent--;
-  return p;
 #else
-  return gc (size);
+  p = gc (size);
 #endif
+  if (stats) stats_gc_end (size);
+  return p;
 }
 # endif
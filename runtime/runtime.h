@@ -7,6 +7,15 @@
 # include <stdarg.h>
 # include <stdlib.h>
 # include <sys/mman.h>
+# include <sys/stat.h>
+# include <pthread.h>
+# include <sys/time.h>
+# include <signal.h>
+# include <ucontext.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+# include <fcntl.h>
+# include <unistd.h>
 # include <assert.h>
 # include <errno.h>
 # include <regex.h>
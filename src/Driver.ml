@@ -21,6 +21,12 @@ class options args =
     "  -ds       --- dump stack machine code (the output will be written into .sm file; has no\n" ^
     "                effect if -i option is specfied)\n" ^
     "  -b        --- compile to a stack machine bytecode\n" ^    
+    "  -gas      --- generate an assembler file (.s) and compile it with gcc instead of writing\n" ^
+    "                the object file directly; only this way debugging information is generated\n" ^
+    "  --make    --- build the imported units whose sources are in the directory of the input\n" ^
+    "                file as well; the units are rebuilt only if they or their imports change\n" ^
+    "  -j <n>    --- build up to <n> units in parallel with --make (defaults to the number of\n" ^
+    "                processors)\n" ^
     "  -v        --- show version\n" ^
     "  -h        --- show this help\n"
   in
@@ -34,19 +40,21 @@ class options args =
     val mode    = ref (`Default : [`Default | `Eval | `SM | `Compile | `BC])
     val curdir  = Unix.getcwd ()
     val debug   = ref false
-    (* Workaround until Ostap starts to memoize properly *)
-    val const  = ref false
-    (* end of the workaround *)
+    val make    = ref false
+    val gas     = ref false
+    val jobs    = ref (None : int option)
     val dump   = ref 0
     initializer
       let rec loop () =
         match self#peek with
         | Some opt ->
            (match opt with
-            (* Workaround until Ostap starts to memoize properly *)
-            | "-w"  -> self#set_workaround
-            (* end of the workaround *)
             | "-c"  -> self#set_mode `Compile
+            | "--make" -> self#set_make
+            | "-gas" -> self#set_gas
+            | "-j"  -> (match self#peek with
+                        | Some n when (try int_of_string n > 0 with Failure _ -> false) -> self#set_jobs (int_of_string n)
+                        | _ -> raise (Commandline_error "Positive number expected after '-j' specifier"))
             | "-o"  -> (match self#peek with None -> raise (Commandline_error "File name expected after '-o' specifier") | Some fname -> self#set_outfile fname)
             | "-I"  -> (match self#peek with None -> raise (Commandline_error "Path expected after '-I' specifier") | Some path -> self#add_include_path path)
             | "-s"  -> self#set_mode `SM
@@ -66,12 +74,28 @@ class options args =
            loop ()
         | None -> ()
       in loop ()
-    (* Workaround until Ostap starts to memoize properly *)
-    method is_workaround = !const
-    method private set_workaround =
-      const := true
-    (* end of the workaround *)
     method private set_help    = help := true
+    method private set_make    =
+      make  := true;
+      paths := Filename.current_dir_name :: !paths
+    method private set_jobs n  = jobs := Some n
+    method is_make = !make
+    method private set_gas = gas := true
+    method is_gas = !gas
+    method get_jobs =
+      match !jobs with
+      | Some n -> n
+      | None   ->
+         let n =
+           try
+             let inc = Unix.open_process_in "getconf _NPROCESSORS_ONLN 2>/dev/null" in
+             let n   = try int_of_string (input_line inc) with _ -> 1 in
+             ignore (Unix.close_process_in inc);
+             max n 1
+           with _ -> 1
+         in
+         jobs := Some n;
+         n
     method private set_version = version := true
     method private set_dump mask =
       dump := !dump lor mask
@@ -118,6 +142,7 @@ class options args =
       let outf = open_out (Printf.sprintf "%s.%s" name ext) in
       Printf.fprintf outf "%s" contents;
       close_out outf
+    method has_dumps = !dump <> 0
     method dump_AST ast =
       if (!dump land dump_ast) > 0
       then (
@@ -154,6 +179,17 @@ let main =
   try
     let cmd = new options Sys.argv in
     cmd#greet;
+    if cmd#is_make then X86.make cmd;
+    match (match cmd#get_mode with
+           | (`Default | `Compile) when not cmd#has_dumps -> X86.cached cmd
+           | _ -> None)
+    with
+    | Some imports ->
+       (match cmd#get_mode with
+        | `Default -> ignore @@ X86.assemble cmd imports
+        | _        -> ()
+       )
+    | None ->
     match (try Language.run_parser cmd with Language.Semantic_error msg -> `Fail msg) with
     | `Ok prog ->
        cmd#dump_AST (snd prog);
@@ -0,0 +1,177 @@
+(* A writer for ELF relocatable object files for 32-bit x86 *)
+
+(* A relocation: the offset of a 32-bit field in the section, the name of
+   the symbol, and the kind --- the absolute address of the symbol
+   (R_386_32), or the address relative to the field (R_386_PC32). The addend
+   is stored in the field itself. *)
+type reloc = {offset : int; symbol : string; relative : bool}
+
+(* A section: the name, the flags (see shf_* below), the contents, and the
+   relocations of the contents *)
+type section = {name : string; flags : int; contents : string; relocs : reloc list}
+
+(* A symbol: the name, the name of the section where it is defined along
+   with its offset in the section, and the binding. The symbols which are
+   referenced by relocations but not listed are added as undefined global
+   symbols. *)
+type symbol = {sname : string; section : string; value : int; global : bool}
+
+let shf_write = 0x1
+let shf_alloc = 0x2
+let shf_exec  = 0x4
+
+let sht_progbits = 1
+let sht_symtab   = 2
+let sht_strtab   = 3
+let sht_rel      = 9
+
+(* A string table: the contents and the offsets of the strings added *)
+class strtab =
+  object
+    val buf = let b = Buffer.create 256 in Buffer.add_char b '\000'; b
+    val map = Hashtbl.create 256
+    method add s =
+      try Hashtbl.find map s
+      with Not_found ->
+        let i = Buffer.length buf in
+        Buffer.add_string buf s;
+        Buffer.add_char buf '\000';
+        Hashtbl.add map s i;
+        i
+    method contents = Buffer.contents buf
+  end
+
+let add_int16 buf n =
+  Buffer.add_char buf (Char.chr (n land 0xff));
+  Buffer.add_char buf (Char.chr ((n lsr 8) land 0xff))
+
+let add_int32 buf n =
+  add_int16 buf (n land 0xffff);
+  add_int16 buf ((n asr 16) land 0xffff)
+
+(* Writes an object file with the given sections and symbols *)
+let write fname sections symbols =
+  let defined = Hashtbl.create 256 in
+  List.iter (fun s -> Hashtbl.replace defined s.sname ()) symbols;
+  let undefined =
+    List.rev @@
+    List.fold_left
+      (fun acc sec ->
+         List.fold_left
+           (fun acc r ->
+              if Hashtbl.mem defined r.symbol
+              then acc
+              else (
+                Hashtbl.add defined r.symbol ();
+                {sname = r.symbol; section = ""; value = 0; global = true} :: acc
+              )
+           )
+           acc sec.relocs
+      )
+      [] sections
+  in
+  (* Symbol table: the null symbol, the local symbols, then the global ones *)
+  let locals, globals = List.partition (fun s -> not s.global) symbols in
+  let symbols = locals @ globals @ undefined in
+  let symindex = Hashtbl.create 256 in
+  List.iteri (fun i s -> Hashtbl.replace symindex s.sname (i+1)) symbols;
+  (* Section indices: 0 is the null section, then the given sections, their
+     relocations, the symbol table, the string tables and the stack note *)
+  let nsections = List.length sections in
+  let secindex name =
+    let rec find i = function
+    | []     -> invalid_arg (Printf.sprintf "Elf.write: unknown section \"%s\"" name)
+    | s :: tl -> if s.name = name then i else find (i+1) tl
+    in
+    find 1 sections
+  in
+  let strtab = new strtab in
+  let symtab = Buffer.create 1024 in
+  Buffer.add_string symtab (String.make 16 '\000');
+  List.iter
+    (fun s ->
+       add_int32 symtab (strtab#add s.sname);
+       add_int32 symtab s.value;
+       add_int32 symtab 0;
+       Buffer.add_char symtab (Char.chr (if s.global then 0x10 else 0));
+       Buffer.add_char symtab '\000';
+       add_int16 symtab (if s.section = "" then 0 else secindex s.section)
+    )
+    symbols;
+  let rels =
+    List.concat @@
+    List.mapi
+      (fun i sec ->
+         if sec.relocs = []
+         then []
+         else
+           let buf = Buffer.create 256 in
+           List.iter
+             (fun r ->
+                add_int32 buf r.offset;
+                add_int32 buf ((Hashtbl.find symindex r.symbol lsl 8) lor (if r.relative then 2 else 1))
+             )
+             sec.relocs;
+           [".rel" ^ sec.name, i+1, Buffer.contents buf]
+      )
+      sections
+  in
+  let symtab_index = nsections + List.length rels + 1 in
+  let shstrtab = new strtab in
+  (* Section headers: name, type, flags, contents, link, info, alignment, entry size *)
+  let headers =
+    List.map (fun s -> s.name, sht_progbits, s.flags, s.contents, 0, 0, (if s.flags land shf_exec <> 0 then 16 else 4), 0) sections @
+    List.map (fun (name, target, contents) -> name, sht_rel, 0x40, contents, symtab_index, target, 4, 8) rels @
+    [".symtab"        , sht_symtab  , 0, Buffer.contents symtab, symtab_index + 1, List.length locals + 1, 4, 16;
+     ".strtab"        , sht_strtab  , 0, strtab#contents       , 0, 0, 1, 0;
+     ".note.GNU-stack", sht_progbits, 0, ""                    , 0, 0, 1, 0]
+  in
+  let headers = headers @ [".shstrtab", sht_strtab, 0, "", 0, 0, 1, 0] in
+  let names = List.map (fun (name, _, _, _, _, _, _, _) -> shstrtab#add name) headers in
+  let headers =
+    List.map
+      (function (".shstrtab", t, f, _, l, i, a, e) -> ".shstrtab", t, f, shstrtab#contents, l, i, a, e | h -> h)
+      headers
+  in
+  (* Layout: the ELF header, the contents of the sections, the section header table *)
+  let body = Buffer.create 4096 in
+  let align n = while (52 + Buffer.length body) mod n <> 0 do Buffer.add_char body '\000' done in
+  let offsets =
+    List.map
+      (fun (_, _, _, contents, _, _, a, _) ->
+         align a;
+         let offset = 52 + Buffer.length body in
+         Buffer.add_string body contents;
+         offset
+      )
+      headers
+  in
+  align 4;
+  let shoff = 52 + Buffer.length body in
+  let out = Buffer.create (shoff + 40 * (List.length headers + 1)) in
+  Buffer.add_string out "\127ELF\001\001\001";
+  Buffer.add_string out (String.make 9 '\000');
+  add_int16 out 1;                         (* ET_REL  *)
+  add_int16 out 3;                         (* EM_386  *)
+  add_int32 out 1;                         (* version *)
+  add_int32 out 0;                         (* entry   *)
+  add_int32 out 0;                         (* phoff   *)
+  add_int32 out shoff;
+  add_int32 out 0;                         (* flags   *)
+  add_int16 out 52;                        (* ehsize  *)
+  add_int16 out 0;                         (* phentsize *)
+  add_int16 out 0;                         (* phnum   *)
+  add_int16 out 40;                        (* shentsize *)
+  add_int16 out (List.length headers + 1);
+  add_int16 out (List.length headers);     (* shstrndx: the last one *)
+  Buffer.add_buffer out body;
+  Buffer.add_string out (String.make 40 '\000');
+  List.iter2
+    (fun (name, (_, t, f, contents, l, i, a, e)) offset ->
+       List.iter (add_int32 out) [name; t; f; 0; offset; String.length contents; l; i; a; e]
+    )
+    (List.combine names headers)
+    offsets;
+  let outc = open_out_bin fname in
+  Buffer.output_buffer outc out;
+  close_out outc
@@ -174,13 +174,56 @@ module Builtin =
 module State =
   struct
                                  
+    (* Bindings of names to values in a state, kept in persistent AVL trees *)
+    @type 'a names = Leaf | Node of 'a names * string * 'a * 'a names * int with show, html, foldl
+
+    (* Bindings: a function, or the bindings made by "bind" on top of it *)
+    @type 'a bindings = Fun of (string, 'a) arrow | Bound of 'a names * (string, 'a) arrow with show, html, foldl
+
     (* State: global state, local state, scope variables *)
     @type 'a t =
     | I
-    | G of (string * k) list * (string, 'a) arrow
-    | L of (string * k) list * (string, 'a) arrow * 'a t
+    | G of (string * k) list * 'a bindings
+    | L of (string * k) list * 'a bindings * 'a t
     with show, html, foldl
 
+    module Names =
+      struct
+
+        let height = function Leaf -> 0 | Node (_, _, _, _, h) -> h
+
+        let node l x v r = Node (l, x, v, r, 1 + max (height l) (height r))
+
+        let balance l x v r =
+          let hl, hr = height l, height r in
+          if hl > hr + 1
+          then match l with
+               | Node (ll, lx, lv, lr, _) when height ll >= height lr -> node ll lx lv (node lr x v r)
+               | Node (ll, lx, lv, Node (lrl, lrx, lrv, lrr, _), _)  -> node (node ll lx lv lrl) lrx lrv (node lrr x v r)
+               | _ -> assert false
+          else if hr > hl + 1
+          then match r with
+               | Node (rl, rx, rv, rr, _) when height rr >= height rl -> node (node l x v rl) rx rv rr
+               | Node (Node (rll, rlx, rlv, rlr, _), rx, rv, rr, _)  -> node (node l x v rll) rlx rlv (node rlr rx rv rr)
+               | _ -> assert false
+          else node l x v r
+
+        let rec add x v = function
+        | Leaf                 -> Node (Leaf, x, v, Leaf, 1)
+        | Node (l, y, w, r, h) ->
+           let c = String.compare x y in
+           if c = 0 then Node (l, x, v, r, h)
+           else if c < 0 then balance (add x v l) y w r
+           else balance l y w (add x v r)
+
+        let rec find x = function
+        | Leaf                 -> raise Not_found
+        | Node (l, y, v, r, _) ->
+           let c = String.compare x y in
+           if c = 0 then v else find x (if c < 0 then l else r)
+
+      end
+
     (* Get the depth level of a state *)
     let rec level = function
     | I            -> 0
@@ -200,14 +243,22 @@ module State =
       fst @@ inner n st
 
     (* Undefined state *)
-    let undefined x =
-      report_error ~loc:(Loc.get x) (Printf.sprintf "undefined name \"%s\"" (Subst.subst x))
+    let undefined =
+      Fun (fun x -> report_error ~loc:(Loc.get x) (Printf.sprintf "undefined name \"%s\"" (Subst.subst x)))
 
     (* Create a state from bindings list *)
-    let from_list l = fun x -> try List.assoc x l with Not_found -> report_error ~loc:(Loc.get x) (Printf.sprintf "undefined name \"%s\"" (Subst.subst x))
+    let from_list l = Fun (fun x -> try List.assoc x l with Not_found -> report_error ~loc:(Loc.get x) (Printf.sprintf "undefined name \"%s\"" (Subst.subst x)))
+
+    (* Look a variable up in bindings *)
+    let lookup s x =
+      match s with
+      | Fun f        -> f x
+      | Bound (m, f) -> try Names.find x m with Not_found -> f x
 
-    (* Bind a variable to a value in a state *)
-    let bind x v s = fun y -> if x = y then v else s y
+    (* Bind a variable to a value in a state; successive binds share one tree *)
+    let bind x v = function
+    | Fun f        -> Bound (Names.add x v Leaf, f)
+    | Bound (m, f) -> Bound (Names.add x v m, f)
 
     (* empty state *)
     let empty = I
@@ -241,8 +292,8 @@ module State =
     let rec eval s x =
       match s with
       | I                       -> report_error "uninitialized state"
-      | G (_, s)                -> s x
-      | L (scope, s, enclosing) -> if in_scope x scope then s x else eval enclosing x
+      | G (_, s)                -> lookup s x
+      | L (scope, s, enclosing) -> if in_scope x scope then lookup s x else eval enclosing x
 
     (* Drops a scope *)
     let leave st st' =
@@ -447,6 +498,8 @@ module Expr =
     | 0 -> fun rest  -> [], rest
     | n -> fun h::tl -> let tl', rest = take (n-1) tl in h :: tl', rest
 
+    (* The reference interpreter: variables are looked up by name through the
+       scopes of the state (see State.eval), no slots are resolved in advance *)
     let rec eval ((st, i, o, vs) as conf) k expr =
       let print_values vs =
         Printf.eprintf "Values:\n%!";
@@ -619,16 +672,31 @@ module Expr =
       let op   i = snd (snd ops.(i)) in
       let nona i = fst ops.(i)      in
       let id   x = x                in
+      (* Both alternatives on each level start with parsing the operand of the
+         next level at the same position, thus without memoization the operand
+         is reparsed twice per level, i.e. exponentially in the number of levels;
+         operands are memoized by the position, the level and the attribute *)
+      let memo   = Hashtbl.create 64 in
+      let inner' = Pervasives.ref (fun _ _ _ _ -> invalid_arg "must not happen") in
+      let operand l atr s =
+        let key = s#coord, l, atr in
+        try Hashtbl.find memo key
+        with Not_found ->
+          let r = !inner' l id atr s in
+          Hashtbl.add memo key r;
+          r
+      in
       let ostap (
         inner[l][c][atr]: f[ostap (
           {n = l                } => x:opnd[atr] {c x}
-        | {n > l && not (nona l)} => (-x:inner[l+1][id][atrl l atr] -o:op[l] y:inner[l][o c x atr][atrr l atr] |
-                                       x:inner[l+1][id][atr] {c x})
-        | {n > l && nona l} => (x:inner[l+1][id][atrl l atr] o:op[l] y:inner[l+1][id][atrr l atr] {c (o id x atr y)} |
-                                x:inner[l+1][id][atr] {c x})
+        | {n > l && not (nona l)} => (-x:operand[l+1][atrl l atr] -o:op[l] y:inner[l][o c x atr][atrr l atr] |
+                                       x:operand[l+1][atr] {c x})
+        | {n > l && nona l} => (x:operand[l+1][atrl l atr] o:op[l] y:operand[l+1][atrr l atr] {c (o id x atr y)} |
+                                x:operand[l+1][atr] {c x})
           )]
       )
       in
+      inner' := inner;
       ostap (inner[0][id][atr])
 
     let atr' = atr
@@ -643,8 +711,22 @@ module Expr =
     let makeParsers env =
     let makeParser, makeBasicParser, makeScopeParser =
       let def s   = let Some def = Obj.magic !defCell in def s in
+      (* The last expression of a sequence is parsed twice (see parse), and so
+         are the sequences nested in it; basic expressions are memoized by the
+         position and the attribute (and the infix table) *)
+      let basics = Hashtbl.create 256 in
+      let basic' = Pervasives.ref (fun _ _ _ -> invalid_arg "must not happen") in
+      let memoBasic infix atr s =
+        let key     = s#coord, atr in
+        let entries = try Hashtbl.find basics key with Not_found -> [] in
+        try List.assq infix entries
+        with Not_found ->
+          let r = !basic' infix atr s in
+          Hashtbl.replace basics key ((infix, r) :: entries);
+          r
+      in
       let ostap (
-      parse[infix][atr]: h:basic[infix][Void] -";" t:parse[infix][atr] {Seq (h, t)} | basic[infix][atr];
+      parse[infix][atr]: h:memoBasic[infix][Void] -";" t:parse[infix][atr] {Seq (h, t)} | memoBasic[infix][atr];
       scope[infix][atr]: <(d, infix')> : def[infix] expr:parse[infix'][atr] {Scope (d, expr)} | {isVoid atr} => <(d, infix')> : def[infix] => {d <> []} => {Scope (d, materialize atr Skip)};
       basic[infix][atr]: !(expr (fun x -> x) (Array.map (fun (a, (atr, l)) -> a, (atr, List.map (fun (s, _, f) -> ostap (- $(s)), f) l)) infix) (primary infix) atr);
       primary[infix][atr]:
@@ -832,28 +914,14 @@ module Expr =
       }
       | -"(" syntax[infix] -")"
       | -"$(" parse[infix][Val] -")"
-    ) in (fun def -> defCell := Obj.magic !def; parse),
-         (fun def -> defCell := Obj.magic !def; basic),
-         (fun def -> defCell := Obj.magic !def; scope)
+    ) in
+    basic' := basic;
+    (fun def -> defCell := Obj.magic !def; parse),
+    (fun def -> defCell := Obj.magic !def; basic),
+    (fun def -> defCell := Obj.magic !def; scope)
     in
     makeParser, makeBasicParser, makeScopeParser
 
-    (* Workaround until Ostap starts to memoize properly *)
-    ostap (
-      constexpr:
-        n:DECIMAL                                          {Const n}
-      | s:STRING                                           {String s}
-      | c:CHAR                                             {Const (Char.code c)}
-      | %"true"                                            {Const 1}
-      | %"false"                                           {Const 0}
-      | "[" es:!(Util.list0)[constexpr] "]"                {Array es}
-      | "{" es:!(Util.list0)[constexpr] "}"                {match es with [] -> Const 0 | _  -> List.fold_right (fun x acc -> Sexp ("cons", [x; acc])) es (Const 0)}
-      | t:UIDENT args:(-"(" !(Util.list)[constexpr] -")")? {Sexp (t, match args with None -> [] | Some args -> args)}
-      | l:$ x:LIDENT                                       {Loc.attach x l#coord; Var x}
-      | -"(" constexpr -")"
-    )
-    (* end of the workaround *)
-
   end
 
 (* Infix helpers *)
@@ -1003,16 +1071,6 @@ module Definition =
 
     let unopt_mod = function None -> `Local | Some m -> m
 
-    ostap (
-      (* Workaround until Ostap starts to memoize properly *)
-      const_var: l:$ name:LIDENT "=" value:!(Expr.constexpr) {
-        Loc.attach name l#coord;
-        name, (`Public, `Variable (Some value))
-       };
-      constdef: %"public" d:!(Util.list (const_var)) ";" {d}
-      (* end of the workaround *)
-    )
-
     let makeParser env exprBasic exprScope =
     let ostap (
       arg : l:$ x:LIDENT {Loc.attach x l#coord; x};
@@ -1106,8 +1164,27 @@ module Interface =
         ) ifxs;
       Buffer.contents buf
 
-    (* Read an interface file *)
-    let read fname =
+    (* Parsed interfaces by file names; each interface is parsed at most once per run *)
+    let cache = Hashtbl.create 16
+
+    (* The digest of the compiler executable; the files cached by one build of
+       the compiler are not used by another one *)
+    let compiler = lazy (Digest.file Sys.executable_name)
+
+    (* Read an interface file. The parsed interface is also stored in a binary
+       file (the name of the interface file with "c" appended), which is used
+       instead of parsing while the digest of the interface file is the same.
+       The binary file starts with a header (the version and the digest of the
+       compiler), so that the files written by other builds are not used *)
+    let rec read fname =
+      match Hashtbl.find_opt cache fname with
+      | Some intfs -> intfs
+      | None       ->
+         let intfs = read_file fname in
+         Hashtbl.add cache fname intfs;
+         intfs
+
+    and read_file fname =
       let ostap (
               funspec: "F" "," i:IDENT ";" {`Fun i};
               varspec: "V" "," i:IDENT ";" {`Variable i};
@@ -1119,19 +1196,49 @@ module Interface =
               interface: (funspec | varspec | import | infix)*
             )
       in
+      let parse s =
+        match Util.parse (object
+                            inherit Matcher.t s
+                            inherit Util.Lexers.ident [] s
+                            inherit Util.Lexers.string s
+                            inherit Util.Lexers.skip  [Matcher.Skip.whitespaces " \t\n"] s
+                          end)
+                         (ostap (interface -EOF))
+        with
+        | `Ok intfs -> intfs
+        | `Fail er  -> report_error (Printf.sprintf "malformed interface file \"%s\": %s" fname er)
+      in
       try
-        let s = Util.read fname in
-        (match Util.parse (object
-                             inherit Matcher.t s
-                             inherit Util.Lexers.ident [] s
-                             inherit Util.Lexers.string s
-                             inherit Util.Lexers.skip  [Matcher.Skip.whitespaces " \t\n"] s
-                           end)
-                          (ostap (interface -EOF))
-         with
-         | `Ok intfs -> Some intfs
-         | `Fail er  -> report_error (Printf.sprintf "malformed interface file \"%s\": %s" fname er)
-        )
+        let s      = Util.read fname in
+        let digest = Digest.string s in
+        let cname  = fname ^ "c" in
+        let cached =
+          try
+            let inc    = open_in_bin cname in
+            let header = (Marshal.from_channel inc : string) in
+            let cached =
+              if header = Version.version ^ Lazy.force compiler
+              then let digest', intfs = Marshal.from_channel inc in
+                   if digest' = digest then Some intfs else None
+              else None
+            in
+            close_in inc;
+            cached
+          with _ -> None
+        in
+        match cached with
+        | Some intfs -> Some intfs
+        | None ->
+           let intfs = parse s in
+           (try
+              let header = Version.version ^ Lazy.force compiler in
+              let outc   = open_out_bin cname in
+              Marshal.to_channel outc header [];
+              Marshal.to_channel outc (digest, intfs) [];
+              close_out outc
+            with Sys_error _ -> ()
+           );
+           Some intfs
       with Sys_error _ -> None
 
     let find import paths =
@@ -1192,10 +1299,6 @@ ostap (
   in
   is, infix
 };
-
-(* Workaround until Ostap starts to memoize properly *)
-    constparse[cmd]: <(is, infix)> : imports[cmd] d:!(Definition.constdef) {(is, []), Expr.Scope (d, Expr.materialize Expr.Weak Expr.Skip)}
-(* end of the workaround *)
 )
 
 let parse cmd =
@@ -1276,4 +1379,4 @@ let run_parser cmd =
        ] s
      end
     )
-    (if cmd#is_workaround then ostap (p:!(constparse cmd) -EOF)  else ostap (p:!(parse cmd) -EOF))
+    (ostap (p:!(parse cmd) -EOF))
@@ -251,177 +251,56 @@ let show_prg p =
 (* Global state of the SM *)
 @type global = (string, value) arrow 
 
-(* Control stack *)
-@type control = (prg * local) list with show
-
-(* Data stack *)
-@type stack = value list with show
-           
-(* The type for the stack machine configuration: control stack, stack, global and local states, 
-   input and output streams
-*)
-type config = control * stack * global * local * int list * int list 
-
 (* Stack machine interpreter
 
-     val eval : env -> config -> prg -> config
-
-   Takes an environment, a configuration and a program, and returns a configuration as a result. The
-   environment is used to locate a label to jump to (via method env#labeled <label_name>)
-*)                                                  
-let split n l =
-  let rec unzip (taken, rest) = function
-  | 0 -> (List.rev taken, rest)
-  | n -> let h::tl = rest in unzip (h::taken, tl) (n-1)
-  in
-  unzip ([], l) n
-
-let update glob loc z = function
-| Value.Global x -> State.bind x z glob
-| Value.Local  i -> loc.locals.(i) <- z; glob
-| Value.Arg    i -> loc.args.(i) <- z; glob
-| Value.Access i -> loc.closure.(i) <- z; glob 
-
-let print_stack memo s =
-  Printf.eprintf "Memo %!";
-  List.iter (fun v -> Printf.eprintf "%s " @@ show(value) v) s;
-  Printf.eprintf "\n%!"
-
-let show_insn = show insn
-              
-let rec eval env (((cstack, stack, glob, loc, i, o) as conf) : config) = function
-| [] -> conf
-| insn :: prg' ->
-   (*
-   Printf.eprintf "eval\n";
-   Printf.eprintf "   insn=%s\n" (show_insn insn);
-   Printf.eprintf "   stack=%s\n" (show(list) (show(value)) stack);
-   Printf.eprintf "end\n";
-    *)
-   (match insn with   
-    | IMPORT _ | PUBLIC _ | EXTERN _ | LINE _ -> eval env conf prg'
-                                    
-    | BINOP  "=="             -> let y::x::stack' = stack in
-                                 let z =
-                                   match x, y with
-                                   | Value.Int _, Value.Int _ -> Value.of_int @@ Expr.to_func "==" (Value.to_int x) (Value.to_int y)
-                                   | Value.Int _, _ | _, Value.Int _ -> Value.of_int 0
-                                   | _ -> failwith "unexpected operands in comparison: %s vs. %s\n"
-                                            (show(Value.t) (fun _ -> "<not supported>") (fun _ -> "<not supported>") x)
-                                            (show(Value.t) (fun _ -> "<not supported>") (fun _ -> "<not supported>") y)
-                                 in
-                                 eval env (cstack, z :: stack', glob, loc, i, o) prg'
-    | BINOP  op               -> let y::x::stack' = stack in eval env (cstack, (Value.of_int @@ Expr.to_func op (Value.to_int x) (Value.to_int y)) :: stack', glob, loc, i, o) prg'
-    | CONST n                 -> eval env (cstack, (Value.of_int n)::stack, glob, loc, i, o) prg'
-    | STRING s                -> eval env (cstack, (Value.of_string @@ Bytes.of_string s)::stack, glob, loc, i, o) prg'
-    | SEXP (s, n)             -> let vs, stack' = split n stack in                                 
-                                 eval env (cstack, (Value.sexp s @@ List.rev vs)::stack', glob, loc, i, o) prg'
-                                 
-    | ELEM                    -> let a :: b :: stack' = stack in
-                                 eval env (env#builtin ".elem" [a; b] (cstack, stack', glob, loc, i, o)) prg'
-                                
-    | LD x                    -> eval env (cstack, (match x with
-                                                    | Value.Global x -> glob x
-                                                    | Value.Local  i -> loc.locals.(i)
-                                                    | Value.Arg    i -> loc.args.(i)
-                                                    | Value.Access i -> loc.closure.(i)) :: stack, glob, loc, i, o) prg'
-
-    | LDA x                   -> eval env (cstack, (Value.Var x) :: stack, glob, loc, i, o) prg'
- 
-    | ST  x                   -> let z::stack' = stack in
-                                 eval env (cstack, z::stack', update glob loc z x, loc, i, o) prg'
-                                 
-    | STI                     -> let z::(Value.Var r)::stack' = stack in 
-                                 eval env (cstack, z::stack', update glob loc z r, loc, i, o) prg'
-
-    | STA                     -> let z::j::stack' = stack in
-                                 (match j with
-                                  | Value.Var r -> eval env (cstack, z::stack', update glob loc z r, loc, i, o) prg'
-                                  | Value.Int _ ->
-                                     let x :: stack' = stack' in                                   
-                                     Value.update_elem x (Value.to_int j) z;
-                                     eval env (cstack, z::stack', glob, loc, i, o) prg'
-                                 )
-                                 
-    | SLABEL _ | LABEL  _ | FLABEL _ -> eval env conf prg'
-                                      
-    | JMP    l                -> eval env conf (env#labeled l)
-    | CJMP  (c, l)            -> let x::stack' = stack in
-                                 eval env (cstack, stack', glob, loc, i, o) (if (c = "z" && Value.to_int x = 0) || (c = "nz" && Value.to_int x <> 0) then env#labeled l else prg')
-
-    | CLOSURE (name, dgs)    -> let closure =
-                                   Array.of_list @@
-                                     List.map (
-                                         function
-                                         | Value.Arg    i -> loc.args.(i)
-                                         | Value.Local  i -> loc.locals.(i)
-                                         | Value.Access i -> loc.closure.(i)
-                                         | _              -> invalid_arg "wrong value in CLOSURE")
-                                       dgs
-                                 in
-                                 eval env (cstack, (Value.Closure ([], name, closure)) :: stack, glob, loc, i, o) prg'
-                                 
-    | CALL (f, n, _)          -> let args, stack' = split n stack in
-                                 if env#is_label f
-                                 then eval env ((prg', loc)::cstack, stack', glob, {args = Array.of_list (List.rev args); locals = [||]; closure = [||]}, i, o) (env#labeled f)
-                                 else eval env (env#builtin f args ((cstack, stack', glob, loc, i, o) : config)) prg'
-
-    | CALLC (n, _)            -> let vs, stack' = split (n+1) stack in
-                                 let f::args    = List.rev vs   in
-                                 (match f with
-                                  | Value.Builtin f ->
-                                     eval env (env#builtin f (List.rev args) ((cstack, stack', glob, loc, i, o) : config)) prg'
-                                  | Value.Closure (_, f, closure) ->
-                                     eval env ((prg', loc)::cstack, stack', glob, {args = Array.of_list args; locals = [||]; closure = closure}, i, o) (env#labeled f)
-                                  | _ -> invalid_arg "not a closure (or a builtin) in CALL: %s\n" @@ show(value) f
-                                 )
-                               
-    | BEGIN (_, _, locals, _, _, _)  -> eval env (cstack, stack, glob, {loc with locals  = Array.init locals (fun _ -> Value.Empty)}, i, o) prg'
-                                 
-    | END                     -> (match cstack with
-                                  | (prg', loc')::cstack' -> eval env (cstack', (*Value.Empty ::*) stack, glob, loc', i, o) prg'
-                                  | []                    -> conf
-                                 )
-  
-    | RET                     -> (match cstack with
-                                  | (prg', loc')::cstack' -> eval env (cstack', stack, glob, loc', i, o) prg'
-                                  | []                    -> conf
-                                 )
-                               
-    | DROP                    -> eval env (cstack, List.tl stack, glob, loc, i, o) prg'
-    | DUP                     -> eval env (cstack, List.hd stack :: stack, glob, loc, i, o) prg'
-    | SWAP                    -> let x::y::stack' = stack in
-                                 eval env (cstack, y::x::stack', glob, loc, i, o) prg'
-    | TAG (t, n)              -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.Sexp (t', a) when t' = t && Array.length a = n -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'
-    | ARRAY n                 -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.Array a when Array.length a = n -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'
-    | PATT StrCmp             -> let x::y::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x, y with (Value.String xs, Value.String ys) when xs = ys -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'               
-    | PATT Array              -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.Array _ -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'
-    | PATT String             -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.String _ -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'
-    | PATT Sexp               -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.Sexp _ -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'
-    | PATT Boxed              -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.Int _ -> 0 | _ -> 1) :: stack', glob, loc, i, o) prg'
-    | PATT UnBoxed            -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.Int _ -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'
-    | PATT Closure            -> let x::stack' = stack in
-                                 eval env (cstack, (Value.of_int @@ match x with Value.Closure _ -> 1 | _ -> 0) :: stack', glob, loc, i, o) prg'
-    | FAIL (l, _)             -> let x::_ = stack in
-                                 raise (Failure (Printf.sprintf "matching value %s failure at %s" (show(value) x) (show(Loc.t) l)))
-   )
-
-(* Top-level evaluation
-
      val run : prg -> int list -> int list
 
-   Takes a program, an input stream, and returns an output stream this program calculates
+   Takes a program, an input stream, and returns an output stream this program calculates.
+
+   The program is first lowered into an array of resolved instructions: labels, line
+   numbers and other pseudo-instructions are dropped, jump and call targets become
+   indices in the array, and global variables become indices in an array of globals.
+   Then the array is run with a mutable program counter, a mutable value stack and a
+   control stack of return addresses and frames.
 *)
 
-module M = Map.Make (String) 
+(* Resolved variable designations *)
+type rdesignation =
+| RGlobal of int
+| RLocal  of int
+| RArg    of int
+| RAccess of int
+
+(* Resolved instructions *)
+type rinsn =
+| RBinop    of (int -> int -> int)
+| REq
+| RConst    of value
+| RString   of string
+| RSexp     of string * int
+| RLd       of rdesignation
+| RLda      of Value.designation
+| RSt       of rdesignation
+| RSti
+| RSta
+| RElem
+| RJmp      of int
+| RCjmp     of bool * int                (* jumps if the value is zero (true) or non-zero (false) *)
+| RBegin    of int
+| REnd
+| RClosure  of string * rdesignation list
+| RCall     of int * int                 (* calls a function at the given address *)
+| RBuiltin  of string * int
+| RCallc    of int
+| RDrop
+| RDup
+| RSwap
+| RTag      of string * int
+| RArray    of int
+| RPatt     of patt
+| RFail     of Loc.t
+
+module M = Map.Make (String)
 
 class indexer prg =
   let rec make_env m = function
@@ -429,29 +308,213 @@ class indexer prg =
   | (LABEL l)  :: tl
   | (FLABEL l) :: tl -> make_env (M.add l tl m) tl
   | _ :: tl          -> make_env m tl
-  in 
+  in
   let m = make_env M.empty prg in
   object
     method is_label l = M.mem l m
     method labeled l = M.find l m
   end
-  
-let run p i = 
-  let module M = Map.Make (String) in
-  let glob = State.undefined in
-  let (_, _, _, _, i, o) =
-    eval
-      object
-         inherit indexer p
-         method builtin f args ((cstack, stack, glob, loc, i, o) as conf : config) = 
-           let f = match f.[0] with 'L' -> String.sub f 1 (String.length f - 1) | _ -> f in
-           let (st, i, o, r) = Language.Builtin.eval (State.I, i, o, []) (List.map Obj.magic @@ List.rev args) f in
-           (cstack, (match r with [r] -> (Obj.magic r)::stack | _ -> Value.Empty :: stack), glob, loc, i, o)
-       end      
-      ([], [], (List.fold_left (fun s (name, value) -> State.bind name value s) glob (Builtin.bindings ())), {locals=[||]; args=[||]; closure=[||]}, i, [])
-      p
+
+(* Lowers a program into an array of resolved instructions; returns the array,
+   the table of addresses of labels and the table of indices of globals *)
+let lower prg =
+  let labels  = Hashtbl.create 1024 in
+  let globals = Hashtbl.create 256  in
+  let n       =
+    List.fold_left
+      (fun n -> function
+       | LABEL l | FLABEL l -> Hashtbl.replace labels l n; n
+       | SLABEL _ | IMPORT _ | PUBLIC _ | EXTERN _ | LINE _ -> n
+       | _ -> n+1
+      )
+      0 prg
+  in
+  let global x =
+    try Hashtbl.find globals x with Not_found ->
+      let i = Hashtbl.length globals in
+      Hashtbl.add globals x i;
+      i
+  in
+  let target l =
+    try Hashtbl.find labels l with Not_found -> failwith (Printf.sprintf "ERROR: undefined label '%s'" l)
+  in
+  let designation = function
+  | Value.Global x -> RGlobal (global x)
+  | Value.Local  i -> RLocal  i
+  | Value.Arg    i -> RArg    i
+  | Value.Access i -> RAccess i
+  | _              -> invalid_arg "wrong designation"
   in
-  o 
+  let code = Array.make n (RConst Value.Empty) in
+  ignore @@
+  List.fold_left
+    (fun i insn ->
+       let emit r = code.(i) <- r; i+1 in
+       match insn with
+       | LABEL _ | FLABEL _ | SLABEL _ | IMPORT _ | PUBLIC _ | EXTERN _ | LINE _ -> i
+       | BINOP "=="          -> emit REq
+       | BINOP op            -> emit (RBinop (Expr.to_func op))
+       | CONST n             -> emit (RConst (Value.of_int n))
+       | STRING s            -> emit (RString s)
+       | SEXP (s, n)         -> emit (RSexp (s, n))
+       | LD x                -> emit (RLd (designation x))
+       | LDA x               -> (* a global may be reached only by reference *)
+                                (match x with Value.Global g -> ignore (global g) | _ -> ());
+                                emit (RLda x)
+       | ST x                -> emit (RSt (designation x))
+       | STI                 -> emit RSti
+       | STA                 -> emit RSta
+       | ELEM                -> emit RElem
+       | JMP l               -> emit (RJmp (target l))
+       | CJMP (c, l)         -> emit (RCjmp (c = "z", target l))
+       | BEGIN (_, _, l, _, _, _) -> emit (RBegin l)
+       | END | RET           -> emit REnd
+       | CLOSURE (name, dgs) -> emit (RClosure (name, List.map designation dgs))
+       | CALL (f, n, _)      -> emit (if Hashtbl.mem labels f then RCall (target f, n) else RBuiltin (f, n))
+       | CALLC (n, _)        -> emit (RCallc n)
+       | DROP                -> emit RDrop
+       | DUP                 -> emit RDup
+       | SWAP                -> emit RSwap
+       | TAG (t, n)          -> emit (RTag (t, n))
+       | ARRAY n             -> emit (RArray n)
+       | PATT p              -> emit (RPatt p)
+       | FAIL (l, _)         -> emit (RFail l)
+       | insn                -> failwith (Printf.sprintf "ERROR: unexpected instruction %s" (show(insn) insn))
+    )
+    0 prg;
+  code, labels, globals
+
+let run p input =
+  let code, labels, gtab = lower p in
+  let globals  = Array.make (Hashtbl.length gtab) Value.Empty in
+  let stack    = ref (Array.make 1024 Value.Empty) in
+  let sp       = ref 0 in
+  let cstack   = ref [] in
+  let loc      = ref {locals=[||]; args=[||]; closure=[||]} in
+  let input    = ref input in
+  let output   = ref [] in
+  let push x   =
+    if !sp = Array.length !stack
+    then (
+      let s = Array.make (2 * !sp) Value.Empty in
+      Array.blit !stack 0 s 0 !sp;
+      stack := s
+    );
+    (!stack).(!sp) <- x;
+    incr sp
+  in
+  let pop () = decr sp; (!stack).(!sp) in
+  let top () = (!stack).(!sp - 1) in
+  (* takes n top values off the stack in the order they were pushed *)
+  let take n = sp := !sp - n; Array.sub !stack !sp n in
+  let load = function
+  | RGlobal i -> globals.(i)
+  | RLocal  i -> (!loc).locals.(i)
+  | RArg    i -> (!loc).args.(i)
+  | RAccess i -> (!loc).closure.(i)
+  in
+  let store z = function
+  | RGlobal i -> globals.(i) <- z
+  | RLocal  i -> (!loc).locals.(i) <- z
+  | RArg    i -> (!loc).args.(i) <- z
+  | RAccess i -> (!loc).closure.(i) <- z
+  in
+  let update z = function
+  | Value.Global x -> store z (RGlobal (Hashtbl.find gtab x))
+  | Value.Local  i -> store z (RLocal  i)
+  | Value.Arg    i -> store z (RArg    i)
+  | Value.Access i -> store z (RAccess i)
+  in
+  let builtin f args =
+    match f with
+    | "read"  -> (match !input with z::i' -> input := i'; push (Value.of_int z) | _ -> failwith "Unexpected end of input")
+    | "write" -> output := Value.to_int args.(0) :: !output; push Value.Empty
+    | _       ->
+       let (_, _, _, r) = Language.Builtin.eval (State.I, [], [], []) (List.map Obj.magic @@ Array.to_list args) f in
+       push (match r with [r] -> Obj.magic r | _ -> Value.Empty)
+  in
+  let call pc' args closure =
+    cstack := (pc', !loc) :: !cstack;
+    loc    := {args = args; locals = [||]; closure = closure}
+  in
+  let bool b = Value.of_int (if b then 1 else 0) in
+  let pc     = ref 0 in
+  let n      = Array.length code in
+  List.iter
+    (fun (name, v) -> try globals.(Hashtbl.find gtab name) <- v with Not_found -> ())
+    (Builtin.bindings ());
+  while !pc < n do
+    let insn = code.(!pc) in
+    incr pc;
+    match insn with
+    | RBinop f     -> let y = pop () in let x = pop () in push (Value.of_int @@ f (Value.to_int x) (Value.to_int y))
+    | REq          -> let y = pop () in let x = pop () in
+                      push (match x, y with
+                            | Value.Int x, Value.Int y -> bool (x = y)
+                            | Value.Int _, _ | _, Value.Int _ -> Value.of_int 0
+                            | _ -> failwith (Printf.sprintf "unexpected operands in comparison: %s vs. %s\n" (show(value) x) (show(value) y))
+                           )
+    | RConst x     -> push x
+    | RString s    -> push (Value.of_string @@ Bytes.of_string s)
+    | RSexp (s, k) -> push (Value.Sexp (s, take k))
+    | RLd x        -> push (load x)
+    | RLda x       -> push (Value.Var x)
+    | RSt x        -> store (top ()) x
+    | RSti         -> let z = pop () in
+                      (match pop () with
+                       | Value.Var r -> update z r; push z
+                       | _           -> invalid_arg "reference expected in STI"
+                      )
+    | RSta         -> let z = pop () in
+                      (match pop () with
+                       | Value.Var r      -> update z r
+                       | Value.Int _ as j -> Value.update_elem (pop ()) (Value.to_int j) z
+                       | _                -> invalid_arg "index or reference expected in STA"
+                      );
+                      push z
+    | RElem        -> let j = pop () in
+                      let b = pop () in
+                      builtin ".elem" [|b; j|]
+    | RJmp l       -> pc := l
+    | RCjmp (z, l) -> if (Value.to_int (pop ()) = 0) = z then pc := l
+    | RBegin k     -> loc := {(!loc) with locals = Array.make k Value.Empty}
+    | REnd         -> (match !cstack with
+                       | (pc', loc') :: cstack' -> cstack := cstack'; loc := loc'; pc := pc'
+                       | []                     -> pc := n
+                      )
+    | RClosure (name, dgs) -> push (Value.Closure ([], name, Array.of_list @@ List.map load dgs))
+    | RCall (l, k)  -> let args = take k in call !pc args [||]; pc := l
+    | RBuiltin (f, k) ->
+       let f = match f.[0] with 'L' -> String.sub f 1 (String.length f - 1) | _ -> f in
+       builtin f (take k)
+    | RCallc k     -> let args = take k in
+                      (match pop () with
+                       | Value.Builtin f -> builtin f args
+                       | Value.Closure (_, f, closure) -> call !pc args closure; pc := Hashtbl.find labels f
+                       | f -> invalid_arg (Printf.sprintf "not a closure (or a builtin) in CALL: %s\n" @@ show(value) f)
+                      )
+    | RDrop        -> decr sp
+    | RDup         -> push (top ())
+    | RSwap        -> let x = pop () in let y = pop () in push x; push y
+    | RTag (t, k)  -> push (match pop () with Value.Sexp (t', a) -> bool (t' = t && Array.length a = k) | _ -> bool false)
+    | RArray k     -> push (match pop () with Value.Array a -> bool (Array.length a = k) | _ -> bool false)
+    | RPatt StrCmp -> let x = pop () in
+                      let y = pop () in
+                      push (match x, y with Value.String xs, Value.String ys -> bool (xs = ys) | _ -> bool false)
+    | RPatt p      -> let x = pop () in
+                      push (bool (match p, x with
+                                  | Array  , Value.Array _
+                                  | String , Value.String _
+                                  | Sexp   , Value.Sexp _
+                                  | UnBoxed, Value.Int _
+                                  | Closure, Value.Closure _ -> true
+                                  | Boxed  , Value.Int _     -> false
+                                  | Boxed  , _               -> true
+                                  | _                        -> false
+                                 ))
+    | RFail l      -> raise (Failure (Printf.sprintf "matching value %s failure at %s" (show(value) (top ())) (show(Loc.t) l)))
+  done;
+  List.rev !output
 
 (* Stack machine compiler
 
@@ -638,6 +701,7 @@ object (self : 'self)
   val funinfo      = new funinfo
   val line         = None
   val end_label    = ""
+  val imported     = M.empty
 
   method show_funinfo = funinfo#show_funinfo
 
@@ -664,7 +728,7 @@ object (self : 'self)
                    List.fold_left
                      (fun env -> function
                       | `Variable name -> env#add_name     name `Extern Mut
-                      | `Fun name      -> env#add_fun_name name `Extern 
+                      | `Fun name      -> (env#add_fun_name name `Extern)#add_imported name import
                       | _              -> env
                      )
                      env
@@ -675,6 +739,15 @@ object (self : 'self)
     in
     env
 
+  method add_imported name unit = {< imported = M.add name unit imported >}
+
+  (* Tells if the name denotes, in the current scope, the function "name"
+     imported from the unit *)
+  method imported_fun name unit =
+    (try M.find name imported = unit with Not_found -> false) &&
+    not (List.exists (fun (n, m, f) -> f && n = name && m <> `Extern) decls) &&
+    (try (match State.eval scope.st name with Value.Fun f -> f = label name | _ -> false) with _ -> false)
+
   method global_scope = scope_index = 0
                       
   method get_label     = (label @@ string_of_int label_index), {< label_index = label_index + 1 >}
@@ -747,7 +820,7 @@ object (self : 'self)
        scope        = init_scope (
                         let rec readdress_to_closure = function
                           | State.L (xs, st, tl) ->
-                             State.L (xs, (fun name -> match st name with Value.Fun _ as x -> x | _ -> Value.Access (~-1)), readdress_to_closure tl)
+                             State.L (xs, State.Fun (fun name -> match State.lookup st name with Value.Fun _ as x -> x | _ -> Value.Access (~-1)), readdress_to_closure tl)
                           | st -> st
                         in
                         readdress_to_closure st'
@@ -868,6 +941,47 @@ object (self : 'self)
        | _                    -> self, []    
 end
   
+(* Fusion of list and array pipelines: a fold or a map over the result of a
+   map or a filter is rewritten into a single traversal of the source, so the
+   intermediate list (array) is not built. Only the functions of the standard
+   units List and Array (as resolved in the scope of the call) are fused. The
+   arguments are evaluated once and in the original order, but the calls of
+   the functions of the stages get interleaved, which is observable only if
+   they have side effects. *)
+module Fusion =
+  struct
+
+    let index = Stdlib.ref 0
+
+    let fresh () = incr index; Printf.sprintf "fuse$%d" !index
+
+    (* Binds the values of es to fresh variables (in order) for the body *)
+    let bind es body =
+      let xs = List.map (fun _ -> fresh ()) es in
+      Expr.Scope (List.map2 (fun x e -> x, (`Local, `Variable (Some e))) xs es,
+                  body (List.map (fun x -> Expr.Var x) xs))
+
+    let lambda1 body = let x = fresh () in Expr.Lambda ([x], body (Expr.Var x))
+
+    let lambda2 body = let a = fresh () in let x = fresh () in Expr.Lambda ([a; x], body (Expr.Var a) (Expr.Var x))
+
+    (* Rewrites a call of f with the arguments args, if it heads a pipeline;
+       std tells if a name denotes the function of a standard unit *)
+    let rewrite std f args =
+      let call f args = Expr.Call (f, args) in
+      let inner g = function Expr.Call (Expr.Var g', [_; _]) -> g' = g && std g | _ -> false in
+      let fold    = std f && (f = "foldl" || f = "foldlArray") in
+      match args with
+      | [k; acc; (Expr.Call (_, [h; src]) as e)] when fold && inner (if f = "foldl" then "map" else "mapArray") e ->
+         Some (bind [k; acc; h] (function [k; acc; h] -> call (Expr.Var f) [lambda2 (fun a x -> call k [a; call h [x]]); acc; src] | _ -> assert false))
+      | [k; acc; (Expr.Call (_, [p; src]) as e)] when fold && f = "foldl" && inner "filter" e ->
+         Some (bind [k; acc; p] (function [k; acc; p] -> call (Expr.Var f) [lambda2 (fun a x -> Expr.If (call p [x], call k [a; x], a)); acc; src] | _ -> assert false))
+      | [k; (Expr.Call (_, [h; src]) as e)] when f = "map" && std f && inner "map" e ->
+         Some (bind [k; h] (function [k; h] -> call (Expr.Var f) [lambda1 (fun x -> call k [call h [x]]); src] | _ -> assert false))
+      | _ -> None
+
+  end
+
 let compile cmd ((imports, infixes), p) =
   let rec pattern env lfalse = function
   | Pattern.Wildcard        -> env, false, [DROP]
@@ -940,6 +1054,11 @@ let compile cmd ((imports, infixes), p) =
         (List.rev bindings)
     in      
     env, (List.flatten code) @ [DROP]
+  and std env name =
+    match name with
+    | "foldl" | "map" | "filter"   -> env#imported_fun name "List"
+    | "foldlArray" | "mapArray"    -> env#imported_fun name "Array"
+    | _                            -> false
   and add_code (env, flag, s) l f s' = env, f, s @ (if flag then [LABEL l] else []) @ s'
   and compile_list tail l env = function
   | []    -> env, false, []
@@ -949,6 +1068,22 @@ let compile cmd ((imports, infixes), p) =
      let env, flag1, s1 = compile_expr false les env e  in
      let env, flag2, s2 = compile_list tail  l   env es in
      add_code (env, flag1, s1) les flag2 s2
+  and compile_call tail env f args =
+    let lcall, env = env#get_label in
+    match f with
+    | Expr.Var name ->
+       let env, line = env#gen_line name in
+       let env, acc  = env#lookup name in
+       (match acc with
+        | Value.Fun name ->
+           let env = env#register_call name in
+           let env, f, code = add_code (compile_list false lcall env args) lcall false [PCALLC (List.length args, tail)]  in
+           env, f, line @ (PPROTO (name, env#current_function) :: code)
+        | _ ->
+           add_code (compile_list false lcall env (f :: args)) lcall false [CALLC (List.length args, tail)]
+       )
+    | _ -> add_code (compile_list false lcall env (f :: args)) lcall false [CALLC (List.length args, tail)]
+
   and compile_expr tail l env = function
   | Expr.Lambda (args, b) ->
      let env, lines = List.fold_left (fun (env, acc) name -> let env, ln = env#gen_line name in env, acc @ ln) (env, []) args in 
@@ -991,21 +1126,9 @@ let compile cmd ((imports, infixes), p) =
   | Expr.Binop (op, x, y)   -> let lop, env = env#get_label in
                                add_code (compile_list false lop env [x; y]) lop false [BINOP op]
                                
-  | Expr.Call (f, args)     -> let lcall, env = env#get_label in
-                               (match f with
-                                | Expr.Var name ->
-                                   let env, line = env#gen_line name in
-                                   let env, acc  = env#lookup name in
-                                   (match acc with
-                                    | Value.Fun name ->
-                                       let env = env#register_call name in
-                                       let env, f, code = add_code (compile_list false lcall env args) lcall false [PCALLC (List.length args, tail)]  in
-                                       env, f, line @ (PPROTO (name, env#current_function) :: code)
-                                    | _ ->
-                                       add_code (compile_list false lcall env (f :: args)) lcall false [CALLC (List.length args, tail)]
-                                   )
-                                  
-                                | _ -> add_code (compile_list false lcall env (f :: args)) lcall false [CALLC (List.length args, tail)]
+  | Expr.Call (f, args)     -> (match (match f with Expr.Var f -> Fusion.rewrite (std env) f args | _ -> None) with
+                                | Some e -> compile_expr tail l env e
+                                | None   -> compile_call tail env f args
                                )
                                     
   | Expr.Array  xs          -> let lar, env = env#get_label in
@@ -487,6 +487,7 @@ let compile cmd env imports code =
                 Meta (Printf.sprintf "\t.set\t%s,\t%d" env#lsize (env#allocated * word_size));
                 Meta (Printf.sprintf "\t.set\t%s,\t%d" env#allocated_size env#allocated);
                 Meta (Printf.sprintf "\t.size %s, .-%s" name name);
+                Label env#fend
                ]
 
           | RET ->
@@ -586,6 +587,8 @@ class env prg =
     val externs         = S.empty
     val nlabels         = 0
     val first_line      = true
+    val funs            = []      (* functions and their closure flags *)
+    val lines           = []      (* line labels and line numbers      *)
                         
     method publics = S.elements publics
                    
@@ -746,11 +749,21 @@ class env prg =
                      
     (* enters a function *)
     method enter f nargs nlocals has_closure =
-      {< nargs = nargs; static_size = nlocals; stack_slots = nlocals; stack = []; fname = f; has_closure = has_closure; first_line = true >}
+      {< nargs = nargs; static_size = nlocals; stack_slots = nlocals; stack = []; fname = f; has_closure = has_closure; first_line = true;
+         funs = (f, has_closure) :: funs >}
 
     (* returns a label for the epilogue *)
     method epilogue = Printf.sprintf "L%s_epilogue" fname
 
+    (* returns a label for the end of the function *)
+    method fend = Printf.sprintf ".L%s_end" fname
+
+    (* gets all functions with their closure flags *)
+    method funs = List.rev funs
+
+    (* gets all line labels with their line numbers *)
+    method lines = List.rev lines
+
     (* returns a name for local size meta-symbol *)
     method lsize = Printf.sprintf "L%s_SIZE" fname
                     
@@ -766,7 +779,7 @@ class env prg =
     (* generate a line number information for current function *)
     method gen_line line =
       let lab = Printf.sprintf ".L%d" nlabels in
-      {< nlabels = nlabels + 1; first_line = false >},
+      {< nlabels = nlabels + 1; first_line = false; lines = (lab, line) :: lines >},
       if fname = "main"
       then
          [Meta (Printf.sprintf "\t.stabn 68,0,%d,%s" line lab); Label lab]
@@ -776,12 +789,23 @@ class env prg =
       
   end
 
+(* Profiling information for the sampling profiler of the runtime. Each
+   function is described in the section lama_funcs by a record of its start
+   and end addresses, its name, its source file, and whether it saves the
+   closure register before %ebp; the section lama_lines consists of pairs of
+   an address and the source line the code from this address on belongs to *)
+let prof_name f = if f.[0] = 'L' then String.sub f 1 (String.length f - 1) else f
+
+(* Compiles a program into the stack code, then into x86 instructions *)
+let gencode cmd prog =
+  let sm = SM.compile cmd prog in
+  compile cmd (new env sm) (fst (fst prog)) sm
+
 (* Generates an assembler text for a program: first compiles the program into
    the stack code, then generates x86 assember code, then prints the assembler file
 *)
 let genasm cmd prog =
-  let sm        = SM.compile cmd prog in
-  let env, code = compile cmd (new env sm) (fst (fst prog)) sm in
+  let env, code = gencode cmd prog in
   let globals =
     List.map (fun s -> Meta (Printf.sprintf "\t.globl\t%s" s)) env#publics
   in
@@ -797,6 +821,20 @@ let genasm cmd prog =
                    env#globals
               )
   in
+  let funs = env#funs in
+  let prof =
+    [Meta "\t.data";
+     Meta (Printf.sprintf ".Lprof_file:\t.string\t\"%s\"" (Filename.basename cmd#get_infile))] @
+    List.mapi (fun i (f, _) -> Meta (Printf.sprintf ".Lprof_name%d:\t.string\t\"%s\"" i (prof_name f))) funs @
+    [Meta "\t.section lama_funcs,\"aw\",@progbits"] @
+    List.mapi
+      (fun i (f, closure) ->
+         Meta (Printf.sprintf "\t.int\t%s, .L%s_end, .Lprof_name%d, .Lprof_file, %d" f f i (if closure then 1 else 0))
+      )
+      funs @
+    [Meta "\t.section lama_lines,\"aw\",@progbits"] @
+    List.map (fun (l, n) -> Meta (Printf.sprintf "\t.int\t%s, %d" l n)) env#lines
+  in
   let asm = Buffer.create 1024 in
   List.iter
     (fun i -> Buffer.add_string asm (Printf.sprintf "%s\n" @@ show i))
@@ -805,16 +843,266 @@ let genasm cmd prog =
       globals @
       data @
       [Meta "\t.text"; Label ".Ltext"; Meta "\t.stabs \"data:t1=r1;0;4294967295;\",128,0,0,0"] @          
-      code);
+      code @
+      prof);
   Buffer.contents asm
 
+(* Generates an object file for a program directly, without the assembler:
+   encodes the instructions into the text section of an ELF relocatable
+   object (see Elf) and lays out the data sections the same way as genasm
+   does. The assembler directives, except .set, carry debugging and unwinding
+   information only, and are omitted.
+*)
+let genobj cmd prog fname =
+  let env, code = gencode cmd prog in
+  let text   = Buffer.create 4096 in
+  let labels = Hashtbl.create 1024 in
+  let sets   = Hashtbl.create 64 in
+  let fixups = Pervasives.ref [] in
+  let byte b  = Buffer.add_char text (Char.chr (b land 0xff)) in
+  let int32 n = Elf.add_int32 text n in
+  let fixup relative x = fixups := (Buffer.length text, x, relative) :: !fixups; int32 0 in
+  (* x86 register numbers for regs *)
+  let reg_code = [|3; 1; 6; 7; 0; 2; 5; 4|] in
+  let operand = function
+  | R i          -> `Reg reg_code.(i)
+  | S i          -> `Mem (5, if i >= 0 then - (stack_offset i) else stack_offset i)
+  | C            -> `Mem (5, 4)
+  | M x          -> if x.[0] = '$' then `Sym (String.sub x 1 (String.length x - 1)) else `Abs x
+  | L n          -> `Imm n
+  | I (n, R i)   -> `Mem (reg_code.(i), n)
+  | x            -> invalid_arg (Printf.sprintf "genobj: unsupported operand %s" (show_opnd x))
+  in
+  let modrm r = function
+  | `Reg b       -> byte (0xc0 lor (r lsl 3) lor b)
+  | `Mem (b, d)  ->
+     let md = if d = 0 && b <> 5 then 0 else if d >= -128 && d < 128 then 1 else 2 in
+     byte ((md lsl 6) lor (r lsl 3) lor b);
+     if b = 4 then byte 0x24;
+     if md = 1 then byte d else if md = 2 then int32 d
+  | `Abs x       -> byte ((r lsl 3) lor 5); fixup false x
+  | _            -> invalid_arg "genobj: register or memory operand expected"
+  in
+  let imm = function
+  | `Imm n -> int32 n
+  | `Sym x -> fixup false x
+  | _      -> invalid_arg "genobj: immediate operand expected"
+  in
+  let reg = function
+  | `Reg r -> r
+  | _      -> invalid_arg "genobj: register operand expected"
+  in
+  let cc = function
+  | "e" | "z"   -> 0x4
+  | "ne" | "nz" -> 0x5
+  | "l"         -> 0xc
+  | "ge"        -> 0xd
+  | "le"        -> 0xe
+  | "g"         -> 0xf
+  | s           -> invalid_arg (Printf.sprintf "genobj: unknown condition \"%s\"" s)
+  in
+  let alu = function
+  | "+"   -> 0
+  | "!!"  -> 1
+  | "&&"  -> 4
+  | "-"   -> 5
+  | "^"   -> 6
+  | "cmp" -> 7
+  | _     -> failwith "unknown binary operator"
+  in
+  let encode = function
+  | Cltd               -> byte 0x99
+  | Set   (suf, s)     -> byte 0x0f; byte (0x90 lor cc suf);
+                          modrm 0 (`Reg (match s with "%al" -> 0 | "%cl" -> 1 | "%dl" -> 2 | "%bl" -> 3 | _ -> invalid_arg "genobj: unknown byte register"))
+  | IDiv   x           -> byte 0xf7; modrm 7 (operand x)
+  | Binop (op, x, y)   ->
+     (match op, operand x, operand y with
+      | "*", ((`Imm _ | `Sym _) as i), y -> byte 0x69; modrm (reg y) y; imm i
+      | "*", x, y                        -> byte 0x0f; byte 0xaf; modrm (reg y) x
+      | "test", ((`Imm _ | `Sym _) as i), y -> byte 0xf7; modrm 0 y; imm i
+      | "test", `Reg r, y                -> byte 0x85; modrm r y
+      | "test", x, y                     -> byte 0x85; modrm (reg y) x
+      | op, `Imm n, y when n >= -128 && n < 128 -> byte 0x83; modrm (alu op) y; byte n
+      | op, ((`Imm _ | `Sym _) as i), y -> byte 0x81; modrm (alu op) y; imm i
+      | op, `Reg r, y                    -> byte ((alu op lsl 3) lor 1); modrm r y
+      | op, x, y                         -> byte ((alu op lsl 3) lor 3); modrm (reg y) x
+     )
+  | Mov   (x, y)       ->
+     (match operand x, operand y with
+      | ((`Imm _ | `Sym _) as i), `Reg r -> byte (0xb8 + r); imm i
+      | ((`Imm _ | `Sym _) as i), y      -> byte 0xc7; modrm 0 y; imm i
+      | `Reg r, y                        -> byte 0x89; modrm r y
+      | x, y                             -> byte 0x8b; modrm (reg y) x
+     )
+  | Lea   (x, y)       -> byte 0x8d; modrm (reg (operand y)) (operand x)
+  | Push   x           ->
+     (match operand x with
+      | `Reg r                    -> byte (0x50 + r)
+      | (`Imm _ | `Sym _) as i    -> byte 0x68; imm i
+      | x                         -> byte 0xff; modrm 6 x
+     )
+  | Pop    x           ->
+     (match operand x with
+      | `Reg r -> byte (0x58 + r)
+      | x      -> byte 0x8f; modrm 0 x
+     )
+  | Ret                -> byte 0xc3
+  | Call   f           -> byte 0xe8; fixup true f
+  | CallI  x           -> byte 0xff; modrm 2 (`Mem (reg (operand x), 0))
+  | Label  l           -> Hashtbl.replace labels l (Buffer.length text)
+  | Jmp    l           -> byte 0xe9; fixup true l
+  | CJmp  (s, l)       -> byte 0x0f; byte (0x80 lor cc s); fixup true l
+  | Meta   s           -> (try Scanf.sscanf s " .set %s@, %d" (fun x n -> Hashtbl.replace sets x n) with _ -> ())
+  | Dec    x           -> byte 0xff; modrm 1 (operand x)
+  | Or1    x           -> byte 0x83; modrm 1 (operand x); byte 1
+  | Sal1   x           -> byte 0xd1; modrm 4 (operand x)
+  | Sar1   x           -> byte 0xd1; modrm 7 (operand x)
+  | Repmovsl           -> byte 0xf3; byte 0xa5
+  in
+  List.iter encode code;
+  let text = Buffer.to_bytes text in
+  let patch offset n =
+    let b = Buffer.create 4 in
+    Elf.add_int32 b n;
+    Bytes.blit_string (Buffer.contents b) 0 text offset 4
+  in
+  (* Resolves the references to .set constants and to the labels in the text;
+     the rest are left to the linker *)
+  let relocs =
+    List.fold_left
+      (fun acc (offset, x, relative) ->
+         match relative, Hashtbl.find_opt sets x, Hashtbl.find_opt labels x with
+         | false, Some n, _    -> patch offset n; acc
+         | true , _, Some addr -> patch offset (addr - offset - 4); acc
+         | true , _, _         -> patch offset (-4); {Elf.offset = offset; Elf.symbol = x; Elf.relative = true} :: acc
+         | false, _, _         -> {Elf.offset = offset; Elf.symbol = x; Elf.relative = false} :: acc
+      )
+      []
+      !fixups
+  in
+  let referenced = Hashtbl.create 64 in
+  List.iter (fun r -> Hashtbl.replace referenced r.Elf.symbol ()) relocs;
+  let publics = S.of_list env#publics in
+  let symbol section (x, value) = {Elf.sname = x; Elf.section = section; Elf.value = value; Elf.global = S.mem x publics} in
+  (* Data: the strings and _init in .data, the filler and the global variables in custom_data *)
+  let unescape s =
+    (* The contents of a .string directive (see env#string) *)
+    let n   = String.length s in
+    let buf = Buffer.create n in
+    let digits base i =
+      let rec inner i k v =
+        let d =
+          if i >= n || k = 0 then -1
+          else match s.[i] with
+               | '0'..'9' as c -> Char.code c - Char.code '0'
+               | 'a'..'f' as c -> Char.code c - Char.code 'a' + 10
+               | 'A'..'F' as c -> Char.code c - Char.code 'A' + 10
+               | _             -> -1
+        in
+        if d >= 0 && d < base then inner (i+1) (k-1) (v * base + d) else i, v
+      in
+      let j, v = inner i (if base = 8 then 3 else max_int) 0 in
+      Buffer.add_char buf (Char.chr (v land 0xff));
+      j
+    in
+    let rec iterate i =
+      if i < n
+      then
+        if s.[i] = '\\' && i+1 < n
+        then
+          iterate
+            (match s.[i+1] with
+             | 'n'      -> Buffer.add_char buf '\n'; i+2
+             | 't'      -> Buffer.add_char buf '\t'; i+2
+             | 'r'      -> Buffer.add_char buf '\r'; i+2
+             | 'b'      -> Buffer.add_char buf '\b'; i+2
+             | 'f'      -> Buffer.add_char buf '\012'; i+2
+             | '0'..'7' -> digits 8 (i+1)
+             | 'x'      -> digits 16 (i+2)
+             | c        -> Buffer.add_char buf c; i+2
+            )
+        else (Buffer.add_char buf s.[i]; iterate (i+1))
+    in
+    iterate 0;
+    Buffer.contents buf
+  in
+  let data   = Buffer.create 1024 in
+  let custom = Buffer.create 1024 in
+  let define buf x = x, Buffer.length buf in
+  let strings =
+    List.map
+      (fun (s, v) ->
+         let d = define data v in
+         Buffer.add_string data (unescape s);
+         Buffer.add_char data '\000';
+         d
+      )
+      env#strings
+  in
+  let init   = define data "_init" in
+  Elf.add_int32 data 0;
+  let filler = define custom "filler" in
+  for i = 1 to env#max_locals_size do Elf.add_int32 custom 1 done;
+  let globals = List.map (fun x -> let d = define custom x in Elf.add_int32 custom 1; d) env#globals in
+  (* Profiling information (see prof_name); the addresses are relocated
+     against the symbols .Ltext and .Ldata at the starts of the sections *)
+  let add_string buf x = let offset = Buffer.length buf in Buffer.add_string buf x; Buffer.add_char buf '\000'; offset in
+  let file   = add_string data (Filename.basename cmd#get_infile) in
+  let funcs  = Buffer.create 1024 in
+  let lines  = Buffer.create 1024 in
+  let frelocs = Pervasives.ref [] in
+  let lrelocs = Pervasives.ref [] in
+  let word buf relocs x n =
+    (match x with
+     | Some x -> relocs := {Elf.offset = Buffer.length buf; Elf.symbol = x; Elf.relative = false} :: !relocs
+     | None   -> ()
+    );
+    Elf.add_int32 buf n
+  in
+  List.iter
+    (fun (f, closure) ->
+       word funcs frelocs (Some ".Ltext") (Hashtbl.find labels f);
+       word funcs frelocs (Some ".Ltext") (Hashtbl.find labels (Printf.sprintf ".L%s_end" f));
+       word funcs frelocs (Some ".Ldata") (add_string data (prof_name f));
+       word funcs frelocs (Some ".Ldata") file;
+       word funcs frelocs None (if closure then 1 else 0)
+    )
+    env#funs;
+  List.iter
+    (fun (l, n) ->
+       word lines lrelocs (Some ".Ltext") (Hashtbl.find labels l);
+       word lines lrelocs None n
+    )
+    env#lines;
+  let code_labels =
+    Hashtbl.fold
+      (fun x addr acc ->
+         if String.length x > 2 && String.sub x 0 2 = ".L" && not (Hashtbl.mem referenced x) then acc else (x, addr) :: acc
+      )
+      labels []
+  in
+  let section name flags contents relocs = {Elf.name = name; Elf.flags = flags; Elf.contents = contents; Elf.relocs = relocs} in
+  Elf.write fname
+    [section ".text"       (Elf.shf_alloc lor Elf.shf_exec)  (Bytes.to_string text)   relocs;
+     section ".data"       (Elf.shf_alloc lor Elf.shf_write) (Buffer.contents data)   [];
+     section "custom_data" (Elf.shf_alloc lor Elf.shf_write) (Buffer.contents custom) [];
+     section "lama_funcs"  (Elf.shf_alloc lor Elf.shf_write) (Buffer.contents funcs)  (List.rev !frelocs);
+     section "lama_lines"  (Elf.shf_alloc lor Elf.shf_write) (Buffer.contents lines)  (List.rev !lrelocs)]
+    (symbol ".text" (".Ltext", 0) ::
+     symbol ".data" (".Ldata", 0) ::
+     List.map (symbol ".text") (List.sort compare code_labels) @
+     List.map (symbol ".data") (strings @ [init]) @
+     List.map (symbol "custom_data") (filler :: globals))
+
 let get_std_path () =
   match Sys.getenv_opt "LAMA" with
   | Some s -> s
   | None   -> Stdpath.path
                                       
-(* Builds a program: generates the assembler file and compiles it with the gcc toolchain *)
-let build cmd prog =
+(* Compiles the assembler file of the program with the gcc toolchain (unless
+   the object file was generated directly); when building an executable, links
+   it with the object files of the imports *)
+let assemble cmd imports =
   let find_objects imports paths =
     let module S = Set.Make (String) in
     let rec iterate acc s = function
@@ -833,16 +1121,175 @@ let build cmd prog =
     in
     iterate [] (S.add "Std" S.empty) imports
   in
-  cmd#dump_file "s" (genasm cmd prog);
-  cmd#dump_file "i" (Interface.gen prog);
   let inc  = get_std_path () in
   match cmd#get_mode with
   | `Default ->
-     let objs = find_objects (fst @@ fst prog) cmd#get_include_paths in
+     let objs = find_objects imports cmd#get_include_paths in
      let buf  = Buffer.create 255 in
      List.iter (fun o -> Buffer.add_string buf o; Buffer.add_string buf " ") objs;
-     let gcc_cmdline = Printf.sprintf "gcc %s -m32 %s %s.s %s %s/runtime.a" cmd#get_debug cmd#get_output_option cmd#basename (Buffer.contents buf) inc in
+     let gcc_cmdline = Printf.sprintf "gcc %s -m32 %s %s.%s %s %s/runtime.a -lpthread" cmd#get_debug cmd#get_output_option cmd#basename (if cmd#is_gas then "s" else "o") (Buffer.contents buf) inc in
      Sys.command gcc_cmdline
   | `Compile ->
-     Sys.command (Printf.sprintf "gcc %s -m32 -c %s.s" cmd#get_debug cmd#basename)
+     if cmd#is_gas
+     then Sys.command (Printf.sprintf "gcc %s -m32 -c %s.s" cmd#get_debug cmd#basename)
+     else 0
   | _ -> invalid_arg "must not happen"
+
+(* Build cache. A successful build writes the file <basename>.stamp, which
+   contains the fingerprint of the build followed by the imports of the
+   program, one per line. The fingerprint is the digest of the compiler
+   version and executable, the options which affect the generated code, the
+   source file and the interface files of the imports. While the fingerprint stays the same,
+   the generated files are reused and only the linking is redone. *)
+let stamp_file cmd = cmd#basename ^ ".stamp"
+
+let fingerprint cmd imports =
+  Digest.to_hex @@ Digest.string @@ String.concat "\n" @@
+    Version.version ::
+    Digest.to_hex (Lazy.force Interface.compiler) ::
+    (match cmd#get_mode with `Compile -> "-c" | _ -> "") ::
+    cmd#get_debug ::
+    (if cmd#is_gas then "-gas" else "") ::
+    Digest.to_hex (Digest.file cmd#get_infile) ::
+    List.map
+      (fun import ->
+         let path, _ = Interface.find import cmd#get_include_paths in
+         import ^ " " ^ Digest.to_hex (Digest.file (Filename.concat path (import ^ ".i")))
+      )
+      imports
+
+(* Returns the imports of the program if the results of its previous build are up to date *)
+let cached cmd =
+  let outputs =
+    List.map (fun ext -> cmd#basename ^ ext)
+      (".i" :: match cmd#is_gas, cmd#get_mode with
+               | true , `Compile -> [".s"; ".o"]
+               | true , _        -> [".s"]
+               | false, _        -> [".o"])
+  in
+  try
+    let inc = open_in (stamp_file cmd) in
+    let rec lines acc = try lines (input_line inc :: acc) with End_of_file -> List.rev acc in
+    let stamp = lines [] in
+    close_in inc;
+    match stamp with
+    | fp :: imports when List.for_all Sys.file_exists outputs && fp = fingerprint cmd imports -> Some imports
+    | _ -> None
+  with _ -> None
+
+let save_stamp cmd imports =
+  try
+    let outc = open_out (stamp_file cmd) in
+    List.iter (fun s -> output_string outc s; output_char outc '\n') (fingerprint cmd imports :: imports);
+    close_out outc
+  with Sys_error _ -> ()
+
+(* Builds a program: generates the object file (or the assembler file, with -gas)
+   and links it with the gcc toolchain *)
+let build cmd prog =
+  let imports = fst @@ fst prog in
+  if cmd#is_gas
+  then cmd#dump_file "s" (genasm cmd prog)
+  else genobj cmd prog (cmd#basename ^ ".o");
+  cmd#dump_file "i" (Interface.gen prog);
+  let code = assemble cmd imports in
+  if code = 0 then save_stamp cmd imports;
+  code
+
+(* Returns the imports listed in the header of a source file *)
+let scan_imports fname =
+  let s = Util.read fname in
+  let n = String.length s in
+  let rec skip i =
+    if i >= n then n
+    else
+      match s.[i] with
+      | ' ' | '\t' | '\n' | '\r' -> skip (i+1)
+      | '-' when i+1 < n && s.[i+1] = '-' ->
+         (match String.index_from_opt s i '\n' with Some j -> skip (j+1) | None -> n)
+      | '(' when i+1 < n && s.[i+1] = '*' -> skip (comment (i+2) 1)
+      | _ -> i
+  and comment i depth =
+    if i+1 >= n then n
+    else if s.[i] = '*' && s.[i+1] = ')' then (if depth = 1 then i+2 else comment (i+2) (depth-1))
+    else if s.[i] = '(' && s.[i+1] = '*' then comment (i+2) (depth+1)
+    else comment (i+1) depth
+  in
+  let ident i =
+    let j = ref i in
+    while !j < n && (match s.[!j] with 'a'..'z' | 'A'..'Z' | '0'..'9' | '_' -> true | _ -> false) do incr j done;
+    String.sub s i (!j - i), !j
+  in
+  let rec imports acc i =
+    match ident (skip i) with
+    | "import", j -> names acc j
+    | _           -> List.rev acc
+  and names acc i =
+    match ident (skip i) with
+    | "", _     -> List.rev acc
+    | name, j ->
+       let j = skip j in
+       if j < n && s.[j] = ','
+       then names (name :: acc) (j+1)
+       else imports (name :: acc) (j+1)
+  in
+  imports [] 0
+
+(* Builds a program together with the units it imports (lamac --make). The
+   sources of the units are looked up in the directory of the input file;
+   the units without sources there are expected to be built already (like
+   the standard library). The units are compiled with "lamac -c" in the
+   order of their imports, up to cmd#get_jobs independent units at a time;
+   each compilation is skipped if its build cache is up to date. *)
+let make cmd =
+  let source name = Filename.concat (Filename.dirname cmd#get_infile) (name ^ ".lama") in
+  let local  name = name <> cmd#basename && Sys.file_exists (source name) in
+  let deps = Hashtbl.create 16 in
+  let rec visit name =
+    if not (Hashtbl.mem deps name)
+    then (
+      Hashtbl.add deps name [];
+      let imports = List.filter local (scan_imports (source name)) in
+      Hashtbl.replace deps name imports;
+      List.iter visit imports
+    )
+  in
+  List.iter visit (List.filter local (scan_imports cmd#get_infile));
+  let compile name =
+    let args =
+      [Sys.executable_name; "-c"] @
+      (if cmd#get_debug = "" then ["-g"] else []) @
+      List.concat (List.map (fun p -> ["-I"; p]) (List.rev cmd#get_include_paths)) @
+      [source name]
+    in
+    Unix.create_process Sys.executable_name (Array.of_list args) Unix.stdin Unix.stdout Unix.stderr
+  in
+  let built   = Hashtbl.create 16 in
+  let running = Hashtbl.create 16 in
+  let ready name = List.for_all (Hashtbl.mem built) (Hashtbl.find deps name) in
+  let rec loop pending =
+    if pending <> [] || Hashtbl.length running > 0
+    then (
+      let rec start = function
+      | name :: names when Hashtbl.length running < cmd#get_jobs ->
+         Hashtbl.add running (compile name) name;
+         start names
+      | names -> names
+      in
+      let now, later = List.partition ready pending in
+      let pending = start now @ later in
+      if Hashtbl.length running = 0
+      then report_error (Printf.sprintf "cyclic imports between units %s" (String.concat ", " pending));
+      let pid, status = Unix.wait () in
+      (match Hashtbl.find_opt running pid with
+       | None      -> ()
+       | Some name ->
+          Hashtbl.remove running pid;
+          match status with
+          | Unix.WEXITED 0 -> Hashtbl.add built name ()
+          | _              -> report_error (Printf.sprintf "could not build unit \"%s\"" name)
+      );
+      loop pending
+    )
+  in
+  loop (Hashtbl.fold (fun name _ acc -> name :: acc) deps [])